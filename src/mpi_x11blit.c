@@ -15,8 +15,12 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* For clock_gettime() and sched_setaffinity(). */
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <mpi.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -26,10 +30,25 @@
 #include <Windows.h>
 #else
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
 #define PROGNAME "mpi_x11blit"
 
 #define BITMAP_WIDTH 400
@@ -37,6 +56,101 @@
 #define BITMAP_BPP 3
 #define BITMAP_STRIDE (BITMAP_BPP * BITMAP_WIDTH)
 
+/* Side of the square tiles the image is split into. Rows are distributed
+ * among workers in multiples of this value, so a tile is always owned by a
+ * single worker. */
+#define TILE_SIZE 32
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE * BITMAP_BPP)
+#define TILES_X ((BITMAP_WIDTH + TILE_SIZE - 1) / TILE_SIZE)
+
+/* Number of remote tiles each worker keeps around while warping, and of the
+ * hash buckets they're found through, a power of two. */
+#define WARP_CACHE_TILES 64
+#define WARP_CACHE_BUCKETS (2 * WARP_CACHE_TILES)
+
+/* Side of the tiles strips are laid out in for warps with --layout=morton,
+ * and number of them across the image. */
+#define MORTON_TILE 64
+#define MORTON_TILE_BYTES (MORTON_TILE * MORTON_TILE * BITMAP_BPP)
+#define MORTON_TILES_X ((BITMAP_WIDTH + MORTON_TILE - 1) / MORTON_TILE)
+
+/* Remote warp tiles are fetched from tiled strips a row at a time, with a
+ * stride of one tile row, so each must lie within a single Z-order tile. */
+#if MORTON_TILE % TILE_SIZE
+#error "TILE_SIZE must divide MORTON_TILE"
+#endif
+
+#define FILTER_MAX_STAGES 32
+#define FILTER_MAX_ARGS 12
+
+/* Maximum number of frames temporal filters look back. */
+#define HISTORY_MAX_FRAMES 64
+
+/* Maximum number of layers composited over the input file. */
+#define MAX_LAYERS 8
+
+/* Maximum number of keys that can be bound to filter strings. */
+#define MAX_BINDINGS 16
+
+/* Bump whenever the contents of result cache entries change. */
+#define CACHE_FORMAT_VERSION 1
+
+/* In watch mode, the input file is refreshed once it has been left alone for
+ * WATCH_SETTLE_MS, or WATCH_MAX_DELAY_MS after it started changing. */
+#define WATCH_POLL_MS 250
+#define WATCH_SETTLE_MS 20
+#define WATCH_MAX_DELAY_MS 100
+
+/* When playing back at a target frame rate, quality is raised again after
+ * QUALITY_UPGRADE_FRAMES frames in a row took less than QUALITY_SLACK of
+ * the frame budget. */
+#define QUALITY_SLACK 0.5
+#define QUALITY_UPGRADE_FRAMES 8
+
+/* In progressive mode, the first pass sends tiles at 1/2^PROGRESSIVE_SCALE
+ * of their resolution. */
+#define PROGRESSIVE_SCALE 3
+
+/* Maximum zoom level. Rows are distributed in multiples of TILE_SIZE, so
+ * each worker's rows start on a pixel of every level up to log2(TILE_SIZE).
+ */
+#define ZOOM_MAX 5
+
+/* In browse mode, the renderer keeps up to VIEW_CACHE_BANDS bands of
+ * TILE_SIZE rows around, and prefetches VIEW_PREFETCH_BANDS bands past the
+ * window in the direction it's scrolling. */
+#define VIEW_CACHE_BANDS 64
+#define VIEW_PREFETCH_BANDS 4
+#define VIEW_POLL_MS 5
+
+/* Every band in sight must stay cached while the prefetched ones arrive,
+ * plus one band for a window not aligned to bands. */
+#if VIEW_CACHE_BANDS                                                          \
+    < (BITMAP_HEIGHT + TILE_SIZE - 1) / TILE_SIZE + 1 + VIEW_PREFETCH_BANDS
+#error "VIEW_CACHE_BANDS can't hold the bands in sight and the prefetched ones"
+#endif
+
+/* Inputs of up to INPROC_MAX_BYTES are filtered by threads of the renderer
+ * itself, as spawning workers would take longer than the whole job. */
+#define INPROC_MAX_BYTES (1 << 20)
+
+/* Maximum number of threads per worker. */
+#define MAX_THREADS 256
+
+/* Maximum number of CPUs taken by --affinity. */
+#define MAX_CPUS 1024
+
+/* Pixel buffers are aligned to cache lines, and those of at least
+ * HUGE_PAGE_SIZE are backed by huge pages where possible. */
+#define BUFFER_ALIGN 64
+#define HUGE_PAGE_SIZE (2 << 20)
+
+/* Number of tile messages a worker may have in flight at once. */
+#define TILE_POOL_SIZE 16
+
+/* L2 cache size assumed when the system won't tell. */
+#define DEFAULT_L2_SIZE (256 << 10)
+
 #ifndef min
 /* Already defined by <Windows.h> */
 #define min(a, b)                                                             \
@@ -76,13 +190,163 @@
 #define logf(f, ...) _logf(stdout, f, ##__VA_ARGS__)
 #define errf(f, ...) _logf(stderr, f, ##__VA_ARGS__)
 
-struct rgb_point {
-    uint16_t x, y;
-    uint8_t r, g, b;
+/* Tags of the messages workers send to the renderer. */
+enum message_tag {
+    TAG_TILE, /* a struct tile_header followed by its pixels */
+    TAG_DONE, /* the worker won't send any more pixels */
+    TAG_QUALITY, /* from the renderer, a quality level to stream frames at */
+};
+
+/* Quality levels of streamed frames, lowered whenever the renderer can't
+ * keep up with the target frame rate. */
+enum quality {
+    QUALITY_FULL,
+    QUALITY_CHEAP, /* expensive filter stages are skipped */
+    QUALITY_HALF, /* tiles are also sent at half resolution */
+    QUALITY_QUARTER, /* tiles are also sent at quarter resolution */
+    QUALITY_MAX = QUALITY_QUARTER,
+};
+
+/* Number of resolutions tiles may be sent at. */
+#define QUALITY_SCALES (QUALITY_MAX - QUALITY_HALF + 2)
+
+/* Commands the renderer broadcasts to the workers in watch mode. */
+enum command {
+    CMD_QUIT, /* the window was closed */
+    CMD_REFRESH, /* the input file changed, re-send what changed */
+    CMD_FILTERS, /* followed by the length of a new filter string and the
+                    string itself, re-filter and re-send what changed */
+    CMD_VIEW, /* followed by a number of bands of TILE_SIZE rows and their
+                 indices, send those bands in browse mode */
 };
 
+/* Header of a TAG_TILE message, followed by w * h packed RGB triplets, or
+ * as many as are left once both dimensions are divided by 2^scale and
+ * rounded up. */
+struct tile_header {
+    uint16_t x, y, w, h;
+    uint16_t scale;
+};
+
+struct warp_state;
+
+/* 3D colour lookup table. Entries are packed as 10-bit 0x00BBGGRR triplets
+ * (red varying fastest) to keep the table small enough to stay in L2: a
+ * 33^3 table takes 144 KiB, a 65^3 one 1.1 MiB. */
+struct lut3d {
+    int size;
+    double domain_min[3], domain_max[3];
+    uint32_t *entries;
+    int cell[3][256]; /* lattice cell of every input level */
+    float frac[3][256]; /* position of every input level within its cell */
+};
+
+/* A single stage of the filter chain, e.g. `w(1.5)'. Colour matrix stages
+ * (`m') hold their 3x4 affine matrix in @args, one row per output channel.
+ * 3D LUT stages (`u') refer to their table file through @path. */
+struct filter {
+    char op;
+    int num_args;
+    double args[FILTER_MAX_ARGS];
+    const char *path;
+    int path_len;
+    struct lut3d *lut;
+    struct warp_state *warp; /* set up by the first pass of a warp */
+    struct history *history; /* of temporal filters */
+};
+
+struct filter_chain {
+    size_t len;
+    struct filter stages[FILTER_MAX_STAGES];
+};
+
+enum blend_mode {
+    BLEND_OVER,
+    BLEND_MULTIPLY,
+    BLEND_SCREEN,
+    BLEND_DIFFERENCE,
+};
+
+/* Image composited over the input file. Layers may be RGB or RGBA; the
+ * alpha channel, if any, is scaled by @opacity. */
+struct layer {
+    const char *path;
+    enum blend_mode mode;
+    double opacity;
+};
+
+/* How threads get pinned to CPUs. */
+enum affinity {
+    AFFINITY_NONE,
+    AFFINITY_COMPACT, /* consecutive threads on consecutive CPUs */
+    AFFINITY_SCATTER, /* threads spread evenly over every CPU */
+    AFFINITY_LIST, /* threads on the CPUs given, in turn */
+};
+
+/* Layouts of the strips warps read their source pixels from. */
+enum layout {
+    LAYOUT_ROWS,
+    LAYOUT_MORTON, /* MORTON_TILE square tiles in Z-order */
+};
+
+/* Filter string applied when a key is pressed. */
+struct binding {
+    char key;
+    char *filters;
+};
+
+/* Command line arguments. Workers receive the very same arguments as the
+ * renderer. */
+struct options {
+    char *num_workers, *input_path, *filters;
+    size_t num_layers;
+    struct layer layers[MAX_LAYERS];
+    char *diff_path;
+    int diff_threshold;
+    int stats;
+    char *stats_path;
+    char *cache_dir;
+    int watch;
+    char *control_path;
+    size_t num_bindings;
+    struct binding bindings[MAX_BINDINGS];
+    int keep_alive; /* workers stay around for changes */
+    int num_frames;
+    double fps;
+    int sequence; /* the input is a sequence of frames */
+    int progressive;
+    int zoom; /* the image is shown at 1/2^zoom of its size */
+    int browse; /* rows are fetched as they get scrolled into sight */
+    int headless; /* the renderer has no window */
+    int share; /* the renderer filters a slice of rows as well */
+    int spawn; /* always spawn workers, even for small inputs */
+    int num_threads; /* filtering threads per worker, 1 by default */
+    enum affinity affinity;
+    int num_cpus;
+    int cpus[MAX_CPUS]; /* for AFFINITY_LIST */
+    enum layout layout;
+};
+
+/* Statistics of the input image. The content hash is the sum of the XXH64
+ * hashes of every row, seeded with the row index, so that it does not
+ * depend on how rows are distributed among workers. */
+struct image_stats {
+    /* Reduced with MPI_SUM, keep them together. */
+    uint64_t num_pixels, hash;
+    uint64_t sum[3], sum_sq[3];
+    uint64_t hist[3][256];
+
+    int min[3], max[3];
+};
+#define IMAGE_STATS_SUMS (2 + 3 + 3 + 3 * 256)
+
 static int g_rank = -1, g_size = -1, g_is_renderer = 0;
-static MPI_Datatype g_point_type;
+static int g_num_renderers = 1;
+
+/* Number of slices rows are split into: one per worker, plus one if the
+ * renderer takes a share. */
+static int g_num_slices = 1;
+static struct options g_opts;
 
 /* Generic MPI error handler.
  * This function gets called from within the MPI_Check() macro in case a MPI
@@ -110,294 +374,5970 @@ static void handle_error(int mpi_error, const char *expr)
     _exit(EXIT_FAILURE);
 }
 
-/* Waits for incoming data from other peers in the network and renders the
- * received pixels to an X11 window.
- * @child_comm: Communicator that spawned the worker processes
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ull
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME64_3 0x165667B19E3779F9ull
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ull
+
+static inline uint64_t xxh_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    return xxh_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static inline uint64_t xxh_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+/* Computes the XXH64 hash of a buffer (little-endian hosts only).
+ * @data: Data to be hashed
+ * @len: Length of the data
+ * @seed: Seed
  */
-static void perform_rendering(MPI_Comm *child_comm)
+static uint64_t xxh64(const void *data, size_t len, uint64_t seed)
 {
-#ifdef _WIN32
-    HINSTANCE hInstance = GetModuleHandle(NULL);
+    const uint8_t *p = data, *end = p + len;
+    uint64_t h;
 
-    /* Register window class. */
-    LPCSTR szClassName = PROGNAME;
-    WNDCLASSEX WndClassEx;
-    WndClassEx.cbSize = sizeof(WNDCLASSEX);
-    WndClassEx.style = 0;
-    WndClassEx.lpfnWndProc = DefWindowProc;
-    WndClassEx.cbClsExtra = 0;
-    WndClassEx.cbWndExtra = 0;
-    WndClassEx.hInstance = hInstance;
-    WndClassEx.hIcon = LoadIcon(NULL, IDI_APPLICATION);
-    WndClassEx.hCursor = LoadCursor(NULL, IDC_ARROW);
-    WndClassEx.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
-    WndClassEx.lpszMenuName = NULL;
-    WndClassEx.lpszClassName = szClassName;
-    WndClassEx.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2,
+                 v2 = seed + XXH_PRIME64_2, v3 = seed,
+                 v4 = seed - XXH_PRIME64_1;
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
 
-    if (!RegisterClassEx(&WndClassEx)) {
-        errf("window registration failed (%08x)", GetLastError());
-        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
-        MPI_Finalize();
-        _exit(EXIT_FAILURE);
-        return 0;
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12)
+            + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
     }
 
-    /* Create window. */
-    HWND hWnd = CreateWindowEx(WS_EX_CLIENTEDGE, szClassName, PROGNAME,
-        WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, BITMAP_WIDTH,
-        BITMAP_HEIGHT, NULL, NULL, hInstance, NULL);
-    if (!hWnd) {
-        errf("window creation failed (%08x)", GetLastError());
-        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
-        MPI_Finalize();
-        _exit(EXIT_FAILURE);
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h ^= v * XXH_PRIME64_1;
+        h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME64_5;
+        h = xxh_rotl(h, 11) * XXH_PRIME64_1;
     }
 
-    ShowWindow(hWnd, SW_SHOW);
-    UpdateWindow(hWnd);
+    return xxh_avalanche(h);
+}
 
-    /* Draw bitmap. */
-    HDC hDC = GetDC(hWnd);
+/* Allocations of pixel and message buffers and of filter scratch space, so
+ * that steady-state streaming can be checked to make none. */
+static unsigned long long g_num_allocs;
 
-    for (size_t i = 0; i < BITMAP_WIDTH * BITMAP_HEIGHT; i++) {
-        /* Receive RGB triplets. */
-        struct rgb_point point;
-        MPI_Recv(&point, sizeof(point), MPI_UNSIGNED_CHAR, MPI_ANY_SOURCE,
-            MPI_ANY_TAG, *child_comm, MPI_STATUS_IGNORE);
-        SetPixel(hDC, point.x, point.y, RGB(point.r, point.g, point.b));
+/* Allocates a buffer of pixels aligned to a cache line. Large buffers get
+ * mapped on their own, from huge pages if there are any reserved, or with
+ * transparent huge pages otherwise. Their pages are left untouched, so
+ * they end up on the NUMA node of whoever writes them first.
+ * Returns NULL on failure, the buffer, to be freed with free_buffer(), on
+ * success
+ * @len: Length of the buffer in bytes
+ */
+static void *try_alloc_buffer(size_t len)
+{
+    /* A header in front of the buffer tells how it was allocated. */
+    size_t total = len + BUFFER_ALIGN, *header = NULL;
+#ifdef _WIN32
+    header = _aligned_malloc(total, BUFFER_ALIGN);
+    if (header)
+        *header = 0;
+#else
+    if (total >= HUGE_PAGE_SIZE) {
+        total = (total + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        void *map = mmap(NULL, total, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map == MAP_FAILED) {
+            map = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (map != MAP_FAILED)
+                madvise(map, total, MADV_HUGEPAGE);
+        }
+        if (map != MAP_FAILED) {
+            header = map;
+            *header = total;
+        }
+    } else if (!posix_memalign((void **)&header, BUFFER_ALIGN, total)) {
+        *header = 0;
     }
+#endif
 
-    ReleaseDC(hWnd, hDC);
-    DeleteDC(hDC);
+    if (!header)
+        return NULL;
+    g_num_allocs++;
+    return (uint8_t *)header + BUFFER_ALIGN;
+}
 
-    /* Window event loop. */
-    MSG Msg;
-    while (GetMessage(&Msg, NULL, 0, 0) > 0) {
-        TranslateMessage(&Msg);
-        DispatchMessage(&Msg);
-    }
-#else
-    /* Open display. */
-    const char *display_name = getenv("DISPLAY");
-    Display *display = XOpenDisplay(display_name);
-    if (!display) {
-        errf("could not open display: %s", display_name);
+/* Allocates a buffer of pixels like try_alloc_buffer(), aborting the job on
+ * failure.
+ * Returns the buffer, to be freed with free_buffer()
+ * @len: Length of the buffer in bytes
+ */
+static void *alloc_buffer(size_t len)
+{
+    void *buf = try_alloc_buffer(len);
+    if (!buf) {
+        errf("could not allocate %zu bytes", len);
         MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
         MPI_Finalize();
         _exit(EXIT_FAILURE);
     }
+    return buf;
+}
 
-    /* Create window. */
-    int screen_num = DefaultScreen(display);
-    Window window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0,
-        0, BITMAP_WIDTH, BITMAP_HEIGHT, 0, BlackPixel(display, screen_num),
-        BlackPixel(display, screen_num));
-    GC ctx = XCreateGC(display, window, 0, NULL);
-    XSelectInput(display, window, 0);
-    XMapWindow(display, window);
-    XFlush(display);
-
-    /* Receive RGB triplets. */
-    struct rgb_point point;
-    for (size_t i = 0; i < BITMAP_WIDTH * BITMAP_HEIGHT; i++) {
-        MPI_Recv(&point, 1, g_point_type, MPI_ANY_SOURCE,
-            MPI_ANY_TAG, *child_comm, MPI_STATUS_IGNORE);
-        XSetForeground(display, ctx, RGB(point.r, point.g, point.b));
-        XDrawPoint(display, window, ctx, point.x, point.y);
-        XFlush(display);
-    }
+/* Frees a buffer allocated with alloc_buffer().
+ * @buf: Buffer, may be NULL
+ */
+static void free_buffer(void *buf)
+{
+    if (!buf)
+        return;
 
-    XEvent event;
-    do {
-        XNextEvent(display, &event);
-    } while (event.type != ClientMessage);
-    XDestroyWindow(display, window);
-    XCloseDisplay(display);
+    size_t *header = (size_t *)((uint8_t *)buf - BUFFER_ALIGN);
+#ifdef _WIN32
+    _aligned_free(header);
+#else
+    if (*header)
+        munmap(header, *header);
+    else
+        free(header);
 #endif
 }
 
-static void filter_grayscale(struct rgb_point *dest)
+/* Number of tiles the window is split into for damage tracking. */
+#define CANVAS_TILES_X ((BITMAP_WIDTH + TILE_SIZE - 1) / TILE_SIZE)
+#define CANVAS_TILES_Y ((BITMAP_HEIGHT + TILE_SIZE - 1) / TILE_SIZE)
+
+/* Size of the framebuffer, in bytes. */
+#define CANVAS_BYTES ((size_t)BITMAP_WIDTH * BITMAP_HEIGHT * sizeof(uint32_t))
+
+/* Window the renderer blits received pixels to. */
+struct canvas {
+#ifdef _WIN32
+    HDC hDC;
+#else
+    Display *display; /* NULL for headless renderers */
+    Window window;
+    GC ctx;
+    uint32_t *pixels; /* framebuffer holding the whole canvas */
+    XImage *image; /* the framebuffer, as seen by X */
+    uint8_t damage[CANVAS_TILES_Y][CANVAS_TILES_X]; /* not blitted yet */
+    int top, bottom; /* rows of the canvas shown by this renderer */
+#endif
+};
+
+/* Rows the renderer filters itself whenever it has nothing to draw. */
+struct render_slice {
+    struct filter_chain chain;
+    MPI_File file;
+    int next, end; /* next row to filter, one past the last */
+    uint8_t *band; /* room for TILE_SIZE rows */
+    struct image_stats stats;
+};
+
+static void open_slice(struct render_slice *slice, int num_workers);
+static size_t filter_slice_band(struct render_slice *slice,
+    struct canvas *canvas);
+static void close_slice(struct render_slice *slice);
+
+/* Calculates the rows of the canvas shown by a renderer. Rows are handed
+ * out in whole tiles, like they are among workers.
+ * @renderer: Renderer rank
+ * @num_renderers: Number of renderers
+ * @top: First row shown by the renderer
+ * @bottom: One past the last row shown by the renderer
+ */
+static void renderer_rows(int renderer, int num_renderers, int *top,
+    int *bottom)
 {
-    uint8_t avg = (uint8_t)((dest->r + dest->g + dest->b) / 3);
-    dest->r = dest->g = dest->b = avg;
+    *top = min(CANVAS_TILES_Y * renderer / num_renderers * TILE_SIZE,
+        BITMAP_HEIGHT);
+    *bottom = min(CANVAS_TILES_Y * (renderer + 1) / num_renderers * TILE_SIZE,
+        BITMAP_HEIGHT);
 }
 
-static void filter_invert(struct rgb_point *dest)
+/* Returns the rank of the renderer showing the supplied row of the canvas.
+ * Rows past the bottom of the canvas go to the last renderer.
+ * @y: Row index
+ */
+static int row_renderer(int y)
 {
-    dest->r = 0xff - dest->r;
-    dest->g = 0xff - dest->g;
-    dest->b = 0xff - dest->b;
+    int renderer = 0, top, bottom;
+    for (; renderer < g_num_renderers - 1; renderer++) {
+        renderer_rows(renderer, g_num_renderers, &top, &bottom);
+        if (y < bottom)
+            break;
+    }
+    return renderer;
 }
 
-static void filter_lighten(struct rgb_point *dest)
+/* Largest tile message: a full-width band of TILE_SIZE rows. */
+#define TILE_MSG_MAX                                                          \
+    (sizeof(struct tile_header) + (size_t)TILE_SIZE * BITMAP_STRIDE)
+
+/* Fixed set of tile message buffers, allocated once with MPI_Alloc_mem()
+ * so that MPI may register them for RDMA. Free buffers are kept on a
+ * lock-free stack, so any thread may take or return one, while only the
+ * MPI thread posts sends from them and recycles those that completed. */
+struct msg_pool {
+    uint8_t *mem;
+    size_t msg_len;
+    int capacity;
+    uint64_t head; /* index + 1 of the top free buffer, tagged against ABA */
+    int *next; /* index of the free buffer below each one */
+    MPI_Request *reqs; /* send in flight from each buffer */
+    unsigned long long num_msgs, num_waits;
+};
+
+static struct msg_pool g_msg_pool;
+
+/* Pushes a buffer onto the free stack of a message pool.
+ * @pool: Message pool
+ * @i: Buffer index
+ */
+static void msg_push(struct msg_pool *pool, int i)
 {
-    float tint_factor = 0.25;
-    dest->r = dest->r + (0xff - dest->r) * tint_factor;
-    dest->g = dest->g + (0xff - dest->g) * tint_factor;
-    dest->b = dest->b + (0xff - dest->b) * tint_factor;
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED), top;
+    do {
+        __atomic_store_n(&pool->next[i], (int)(uint32_t)head - 1,
+            __ATOMIC_RELAXED);
+        top = ((head >> 32) + 1) << 32 | (uint32_t)(i + 1);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, top, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-static void filter_darken(struct rgb_point *dest)
+/* Pops a buffer off the free stack of a message pool.
+ * Returns the buffer index, or -1 if there's none
+ * @pool: Message pool
+ */
+static int msg_pop(struct msg_pool *pool)
 {
-    float shade_factor = 0.25;
-    dest->r = dest->r * (1.0 - shade_factor);
-    dest->g = dest->g * (1.0 - shade_factor);
-    dest->b = dest->b * (1.0 - shade_factor);
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE), top;
+    int i;
+    do {
+        i = (int)(uint32_t)head - 1;
+        if (i < 0)
+            return -1;
+        top = ((head >> 32) + 1) << 32
+            | (uint32_t)(__atomic_load_n(&pool->next[i], __ATOMIC_RELAXED)
+                + 1);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, top, 1,
+        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return i;
 }
 
-/* Reads raw RGB data from the supplied input file and sends them out so the
- * renderer process can blit those pixels.
- * @input_path: Path to the file containing the data
- * @filters: Filter string
+/* Allocates the buffers of a message pool, all of them free.
+ * @pool: Message pool
+ * @capacity: Number of buffers
+ * @msg_len: Length of every buffer
  */
-static void read_data(const char *input_path, const char *filters)
+static void init_msg_pool(struct msg_pool *pool, int capacity,
+    size_t msg_len)
 {
-    /* Open input file. */
-    MPI_File input_file;
-    logf("opening file `%s' for reading", input_path);
-    MPI_Check(MPI_File_open(MPI_COMM_WORLD, input_path, MPI_MODE_RDONLY,
-        MPI_INFO_NULL, &input_file));
-
-    /* Calculate chunk length for each peer. */
-    MPI_Offset input_len;
-    MPI_Check_close(&input_file, MPI_File_get_size(input_file, &input_len));
-    if (input_len % BITMAP_STRIDE) {
-        errf("invalid input length. Expected a multiple of %d but got %lld.",
-            BITMAP_STRIDE, input_len);
-        MPI_File_close(&input_file);
-        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
-        MPI_Finalize();
-        _exit(EXIT_FAILURE);
+    memset(pool, 0, sizeof(*pool));
+    pool->msg_len = msg_len;
+    pool->capacity = capacity;
+    MPI_Check(MPI_Alloc_mem(
+        (MPI_Aint)(capacity * msg_len), MPI_INFO_NULL, &pool->mem));
+    pool->next = malloc(capacity * sizeof(int));
+    pool->reqs = malloc(capacity * sizeof(MPI_Request));
+    g_num_allocs += 3;
+    for (int i = capacity - 1; i >= 0; i--) {
+        pool->reqs[i] = MPI_REQUEST_NULL;
+        msg_push(pool, i);
     }
+}
 
-    MPI_Offset chunk_len = input_len / g_size,
-               chunk_start = chunk_len * g_rank,
-               chunk_end = min(input_len, chunk_start + chunk_len) - 1;
-    chunk_len = chunk_end - chunk_start + 1;
-    logf("%lld bytes: [%lld, %lld]", chunk_len, chunk_start, chunk_end);
-
-    /* Allocate buffer for reading chunk. */
-    uint8_t *buf = malloc(chunk_len);
-
-    /* Read from file. */
-    MPI_Datatype element_type = MPI_BYTE;
-    MPI_Datatype array_type;
-    MPI_Check(MPI_Type_contiguous(chunk_len, element_type, &array_type));
-    MPI_Check(MPI_Type_commit(&array_type));
-    MPI_Check(MPI_File_set_view(input_file, chunk_start, element_type,
-        array_type, "native", MPI_INFO_NULL));
-    MPI_Check(MPI_File_read(
-        input_file, buf, chunk_len, MPI_BYTE, MPI_STATUS_IGNORE));
-
-    /* Send data to renderer process. */
-    MPI_Comm parent_comm;
-    MPI_Comm_get_parent(&parent_comm);
-
-    size_t strides = chunk_len / BITMAP_BPP;
-    size_t num_filters = filters ? strlen(filters) : 0;
-    struct rgb_point point;
-    for (size_t off = 0; off < strides; off++) {
-        size_t i = chunk_start / BITMAP_BPP + off;
-        point.x = (i) % BITMAP_WIDTH;
-        point.y = (i) / BITMAP_WIDTH;
-
-        uint8_t *triplet = buf + (off * BITMAP_BPP);
-        point.r = triplet[0];
-        point.g = triplet[1];
-        point.b = triplet[2];
-
-        /* Apply filters as per the supplied filter string */
-        for (size_t i = 0; i < num_filters; i++) {
-            switch (filters[i]) {
-            case 'g':
-                filter_grayscale(&point);
-                break;
-            case 'i':
-                filter_invert(&point);
-                break;
-            case 'l':
-                filter_lighten(&point);
-                break;
-            case 'd':
-                filter_darken(&point);
-                break;
-            }
+/* Takes a free buffer out of a message pool, waiting for a send to
+ * complete if they're all in flight. Only the MPI thread may call this.
+ * Returns the buffer
+ * @pool: Message pool
+ */
+static struct tile_header *get_msg(struct msg_pool *pool)
+{
+    int i = msg_pop(pool);
+    if (i < 0) {
+        int done;
+        MPI_Check(MPI_Testany(
+            pool->capacity, pool->reqs, &i, &done, MPI_STATUS_IGNORE));
+        if (!done) {
+            MPI_Check(MPI_Waitany(
+                pool->capacity, pool->reqs, &i, MPI_STATUS_IGNORE));
+            pool->num_waits++;
+        }
+        if (i == MPI_UNDEFINED) {
+            errf("every tile message buffer is taken");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            MPI_Finalize();
+            _exit(EXIT_FAILURE);
         }
-
-        MPI_Check(MPI_Send(&point, 1, g_point_type, 0, 0, parent_comm));
     }
+    return (struct tile_header *)(pool->mem + i * pool->msg_len);
+}
 
-    free(buf);
-    MPI_Check(MPI_File_close(&input_file));
+/* Returns a buffer that won't be sent to its message pool.
+ * @pool: Message pool
+ * @msg: Buffer
+ */
+static void put_msg(struct msg_pool *pool, struct tile_header *msg)
+{
+    msg_push(pool, (int)(((uint8_t *)msg - pool->mem) / pool->msg_len));
 }
 
-/* Parse the number of workers from the command line arguments.
- * Returns -1 on failure, parsed value on success
- * @str: String to be parsed
+/* Sends a tile message out of a message pool. Its buffer goes back to the
+ * pool once the send completes.
+ * @pool: Message pool
+ * @msg: Buffer, as taken with get_msg()
+ * @len: Length of the message
+ * @comm: Communicator to the renderers
  */
-static int parse_num_workers(char *str)
+static void post_msg(struct msg_pool *pool, struct tile_header *msg,
+    size_t len, MPI_Comm comm)
 {
-    errno = 0;
-    char *endptr;
-    long result = strtol(str, &endptr, 10);
+    int i = (int)(((uint8_t *)msg - pool->mem) / pool->msg_len);
+    MPI_Check(MPI_Isend(msg, (int)len, MPI_BYTE, row_renderer(msg->y),
+        TAG_TILE, comm, &pool->reqs[i]));
+    pool->num_msgs++;
+}
 
-    if (endptr == str)
-        return -1; /* nothing parsed */
+/* Waits for every send out of a message pool, and frees its buffers.
+ * @pool: Message pool
+ */
+static void destroy_msg_pool(struct msg_pool *pool)
+{
+    if (!pool->mem)
+        return;
 
-    if ((result == INT_MAX || result == INT_MIN) && errno == ERANGE)
-        return -1; /* out of range */
-    return (int)result;
+    MPI_Check(MPI_Waitall(pool->capacity, pool->reqs, MPI_STATUSES_IGNORE));
+    MPI_Check(MPI_Free_mem(pool->mem));
+    free(pool->next);
+    free(pool->reqs);
+    pool->mem = NULL;
 }
 
-/* Program entry point.
- * This function returns EXIT_SUCCESS or EXIT_FAILURE if an error occurred
- * during MPI initialization.
- * @argc: Number of arguments
- * @argv: Arguments passed to the program, excluding those of mpicc
+/* Draws a rectangular tile of pixels, scaling it back up to its full size
+ * if it was sent at a lower resolution. On X11 the tile goes to the
+ * framebuffer, and is blitted on the next canvas_flush().
+ * @canvas: Canvas
+ * @tile: Position, size and scale of the tile
+ * @pixels: Packed RGB triplets
  */
-int main(int argc, char **argv)
+static void canvas_draw_tile(struct canvas *canvas,
+    const struct tile_header *tile, const uint8_t *pixels)
 {
-    if (argc < 3) {
-        printf("usage: " PROGNAME " NUM_WORKERS INPUT_FILE [FILTERS]\n\n");
-        return EXIT_SUCCESS;
+    int s = tile->scale;
+    size_t row_len = (size_t)((tile->w + (1 << s) - 1) >> s) * BITMAP_BPP;
+#ifdef _WIN32
+    for (int y = 0; y < tile->h; y++) {
+        for (int x = 0; x < tile->w; x++) {
+            const uint8_t *p
+                = pixels + (y >> s) * row_len + (x >> s) * BITMAP_BPP;
+            SetPixel(canvas->hDC, tile->x + x, tile->y + y,
+                RGB(p[0], p[1], p[2]));
+        }
+    }
+#else
+    int w = min((int)tile->w, BITMAP_WIDTH - tile->x),
+        h = min((int)tile->h, BITMAP_HEIGHT - tile->y);
+    for (int y = 0; y < h; y++) {
+        uint32_t *dest
+            = canvas->pixels + (size_t)(tile->y + y) * BITMAP_WIDTH + tile->x;
+        const uint8_t *row = pixels + (y >> s) * row_len;
+        for (int x = 0; x < w; x++) {
+            const uint8_t *p = row + (x >> s) * BITMAP_BPP;
+            dest[x] = RGB(p[0], p[1], p[2]);
+        }
     }
 
-    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) {
-        errf("MPI initialization failed");
-        return EXIT_FAILURE;
+    for (int ty = tile->y / TILE_SIZE; ty * TILE_SIZE < tile->y + h; ty++) {
+        for (int tx = tile->x / TILE_SIZE; tx * TILE_SIZE < tile->x + w; tx++)
+            canvas->damage[ty][tx] = 1;
     }
+#endif
+}
 
-    MPI_Check(MPI_Comm_rank(MPI_COMM_WORLD, &g_rank));
-    MPI_Check(MPI_Comm_size(MPI_COMM_WORLD, &g_size));
+/* Blits the damaged parts of the framebuffer to the window, merging runs of
+ * damaged tiles into a single blit.
+ * @canvas: Canvas
+ */
+static void canvas_flush(struct canvas *canvas)
+{
+#ifdef _WIN32
+    (void)canvas;
+#else
+    int blitted = 0;
+    for (int ty = 0; ty < CANVAS_TILES_Y; ty++) {
+        for (int tx = 0; tx < CANVAS_TILES_X;) {
+            if (!canvas->damage[ty][tx]) {
+                tx++;
+                continue;
+            }
 
-    struct rgb_point point_dummy;
-    int point_count = 5;
-    int block_lengths[] = { 1, 1, 1, 1, 1 };
-    MPI_Aint block_offsets[] = {
-        (ptrdiff_t)&point_dummy.x - (ptrdiff_t)&point_dummy,
-        (ptrdiff_t)&point_dummy.y - (ptrdiff_t)&point_dummy,
-        (ptrdiff_t)&point_dummy.r - (ptrdiff_t)&point_dummy,
-        (ptrdiff_t)&point_dummy.g - (ptrdiff_t)&point_dummy,
-        (ptrdiff_t)&point_dummy.b - (ptrdiff_t)&point_dummy,
-    };
-    MPI_Datatype block_types[] = { MPI_UNSIGNED_SHORT, MPI_UNSIGNED_SHORT,
-                                   MPI_BYTE, MPI_BYTE, MPI_BYTE };
+            int run = tx;
+            while (run < CANVAS_TILES_X && canvas->damage[ty][run])
+                canvas->damage[ty][run++] = 0;
 
-    MPI_Check(MPI_Type_create_struct(
-        point_count, block_lengths, block_offsets, block_types,
-        &g_point_type));
-    MPI_Check(MPI_Type_commit(&g_point_type));
+            int x = tx * TILE_SIZE, y = ty * TILE_SIZE;
+            if (canvas->display && y >= canvas->top && y < canvas->bottom) {
+                XPutImage(canvas->display, canvas->window, canvas->ctx,
+                    canvas->image, x, y, x, y - canvas->top,
+                    min(run * TILE_SIZE, BITMAP_WIDTH) - x,
+                    min(TILE_SIZE, canvas->bottom - y));
+                blitted = 1;
+            }
+            tx = run;
+        }
+    }
 
-    MPI_Comm parent_comm;
-    MPI_Check(MPI_Comm_get_parent(&parent_comm));
+    if (blitted)
+        XFlush(canvas->display);
+#endif
+}
 
-    if (parent_comm == MPI_COMM_NULL && g_rank == 0) {
-        /* I'm the renderer process. */
+/* Receives the results of a diff run from the workers and prints them.
+ * @child_comm: Communicator that spawned the worker processes
+ */
+static void report_diff_stats(MPI_Comm *child_comm)
+{
+    uint64_t sums[3]; /* changed pixels, squared error, pixels */
+    int max_delta, root = g_rank == 0 ? MPI_ROOT : MPI_PROC_NULL;
+    MPI_Check(
+        MPI_Reduce(NULL, sums, 3, MPI_UINT64_T, MPI_SUM, root, *child_comm));
+    MPI_Check(MPI_Reduce(
+        NULL, &max_delta, 1, MPI_INT, MPI_MAX, root, *child_comm));
+    if (g_rank)
+        return;
+
+    double mse = sums[2] ? (double)sums[1] / (3.0 * sums[2]) : 0.0;
+    logf("diff: %llu of %llu pixels changed (%.4f%%), max. delta %d",
+        (unsigned long long)sums[0], (unsigned long long)sums[2],
+        sums[2] ? 100.0 * sums[0] / sums[2] : 0.0, max_delta);
+    if (mse > 0.0) {
+        logf("diff: PSNR %.3f dB", 10.0 * log10(255.0 * 255.0 / mse));
+    } else {
+        logf("diff: PSNR inf (identical)");
+    }
+}
+
+/* Receives the image statistics from the workers and prints them, writing
+ * them as JSON as well if requested.
+ * @child_comm: Communicator that spawned the worker processes
+ * @local: Statistics of the rows filtered by the renderer, may be NULL
+ */
+static void report_image_stats(MPI_Comm *child_comm,
+    const struct image_stats *local)
+{
+    static const char channel_names[] = "rgb";
+    struct image_stats stats;
+    int root = g_rank == 0 ? MPI_ROOT : MPI_PROC_NULL;
+    MPI_Check(MPI_Reduce(NULL, &stats.num_pixels, IMAGE_STATS_SUMS,
+        MPI_UINT64_T, MPI_SUM, root, *child_comm));
+    MPI_Check(
+        MPI_Reduce(NULL, stats.min, 3, MPI_INT, MPI_MIN, root, *child_comm));
+    MPI_Check(
+        MPI_Reduce(NULL, stats.max, 3, MPI_INT, MPI_MAX, root, *child_comm));
+    if (g_rank)
+        return;
+
+    if (local) {
+        uint64_t *sums = &stats.num_pixels;
+        const uint64_t *local_sums = &local->num_pixels;
+        for (int i = 0; i < IMAGE_STATS_SUMS; i++)
+            sums[i] += local_sums[i];
+        for (int c = 0; c < 3; c++) {
+            stats.min[c] = min(stats.min[c], local->min[c]);
+            stats.max[c] = local->max[c] > stats.max[c] ? local->max[c]
+                                                        : stats.max[c];
+        }
+    }
+
+    /* Fold the per-row hashes into the content hash. */
+    uint64_t hash = xxh_avalanche(stats.hash + stats.num_pixels);
+    double mean[3], variance[3];
+    double n = stats.num_pixels ? (double)stats.num_pixels : 1.0;
+    for (int c = 0; c < 3; c++) {
+        mean[c] = stats.sum[c] / n;
+        variance[c] = stats.sum_sq[c] / n - mean[c] * mean[c];
+        logf("stats: %c mean %.3f, variance %.3f, min. %d, max. %d",
+            channel_names[c], mean[c], variance[c], stats.min[c],
+            stats.max[c]);
+    }
+    logf("stats: %llu pixels, content hash %016llx",
+        (unsigned long long)stats.num_pixels, (unsigned long long)hash);
+
+    if (!g_opts.stats_path)
+        return;
+
+    FILE *file = fopen(g_opts.stats_path, "w");
+    if (!file) {
+        errf("could not write `%s': %s", g_opts.stats_path, strerror(errno));
+        return;
+    }
+
+    fprintf(file, "{\n  \"pixels\": %llu,\n  \"hash\": \"%016llx\",\n",
+        (unsigned long long)stats.num_pixels, (unsigned long long)hash);
+    fprintf(file, "  \"channels\": {\n");
+    for (int c = 0; c < 3; c++) {
+        fprintf(file,
+            "    \"%c\": {\n      \"mean\": %.6f,\n      \"variance\": %.6f,\n"
+            "      \"min\": %d,\n      \"max\": %d,\n      \"histogram\": [",
+            channel_names[c], mean[c], variance[c], stats.min[c],
+            stats.max[c]);
+        for (int v = 0; v < 256; v++) {
+            fprintf(file, "%s%llu", v ? ", " : "",
+                (unsigned long long)stats.hist[c][v]);
+        }
+        fprintf(file, "]\n    }%s\n", c < 2 ? "," : "");
+    }
+    fprintf(file, "  }\n}\n");
+    fclose(file);
+}
+
+/* Workers that are done with the pixels being received, and the number of
+ * times each one is done already with the pixels that come after, as fast
+ * workers may stream a frame ahead of slow ones. Indexed by worker rank. */
+static uint8_t *g_done;
+static int *g_done_ahead;
+
+/* Receives pixels from the workers and draws them until every worker is
+ * done, filtering the renderer's own slice of rows in between, if any.
+ * Every worker is counted once, however many times it's done meanwhile.
+ * Returns the number of pixels drawn
+ * @child_comm: Communicator that spawned the worker processes
+ * @canvas: Canvas to draw onto
+ * @slice: Rows to filter whenever there's nothing to draw, may be NULL
+ */
+static size_t receive_pixels(MPI_Comm *child_comm, struct canvas *canvas,
+    struct render_slice *slice)
+{
+    size_t num_pixels = 0;
+    int num_workers, num_done = 0, coarse = 0;
+    uint8_t *tile_buf = (uint8_t *)get_msg(&g_msg_pool);
+    double start = MPI_Wtime();
+    MPI_Check(MPI_Comm_remote_size(*child_comm, &num_workers));
+    if (!g_done) {
+        g_done = malloc(num_workers);
+        g_done_ahead = calloc(num_workers, sizeof(int));
+        g_num_allocs += 2;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        g_done[i] = g_done_ahead[i] > 0;
+        g_done_ahead[i] -= g_done[i];
+        num_done += g_done[i];
+    }
+
+    while (num_done < num_workers || (slice && slice->next < slice->end)) {
+        /* Get on with our own rows, or blit whatever we've got, whenever we
+         * run out of messages. */
+        MPI_Status status;
+        int pending;
+        MPI_Check(MPI_Iprobe(
+            MPI_ANY_SOURCE, MPI_ANY_TAG, *child_comm, &pending, &status));
+        if (!pending) {
+            if (slice && slice->next < slice->end) {
+                num_pixels += filter_slice_band(slice, canvas);
+                continue;
+            }
+            canvas_flush(canvas);
+            MPI_Check(MPI_Probe(
+                MPI_ANY_SOURCE, MPI_ANY_TAG, *child_comm, &status));
+        }
+
+        const struct tile_header *tile;
+        int len;
+        switch (status.MPI_TAG) {
+        case TAG_TILE:
+            MPI_Check(MPI_Get_count(&status, MPI_BYTE, &len));
+            if ((size_t)len > g_msg_pool.msg_len) {
+                errf("tile message of %d bytes is too long", len);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+                MPI_Finalize();
+                _exit(EXIT_FAILURE);
+            }
+            MPI_Check(MPI_Recv(tile_buf, len, MPI_BYTE, status.MPI_SOURCE,
+                TAG_TILE, *child_comm, MPI_STATUS_IGNORE));
+            tile = (const struct tile_header *)tile_buf;
+            canvas_draw_tile(canvas, tile, tile_buf + sizeof(*tile));
+            num_pixels += (size_t)tile->w * tile->h;
+
+            /* Progressive passes start refining once the coarsest one is
+             * through. */
+            if (tile->scale == PROGRESSIVE_SCALE && !coarse) {
+                coarse = 1;
+            } else if (tile->scale < PROGRESSIVE_SCALE && coarse == 1) {
+                coarse = 2;
+                logf("coarse image received in %.1f ms",
+                    (MPI_Wtime() - start) * 1e3);
+            }
+            break;
+        case TAG_DONE:
+            MPI_Check(MPI_Recv(NULL, 0, MPI_BYTE, status.MPI_SOURCE,
+                TAG_DONE, *child_comm, MPI_STATUS_IGNORE));
+            if (g_done[status.MPI_SOURCE]) {
+                g_done_ahead[status.MPI_SOURCE]++;
+            } else {
+                g_done[status.MPI_SOURCE] = 1;
+                num_done++;
+            }
+            break;
+        }
+    }
+
+    put_msg(&g_msg_pool, (struct tile_header *)tile_buf);
+    canvas_flush(canvas);
+    if (coarse) {
+        logf("full image received in %.1f ms", (MPI_Wtime() - start) * 1e3);
+    }
+    if (g_opts.diff_path)
+        report_diff_stats(child_comm);
+    if (g_opts.stats)
+        report_image_stats(child_comm, slice ? &slice->stats : NULL);
+    return num_pixels;
+}
+
+/* Sleeps for a while.
+ * @ms: Milliseconds to sleep for
+ */
+static void sleep_ms(int ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    poll(NULL, 0, ms);
+#endif
+}
+
+/* Receives the input from the workers and draws it. Sequences are played
+ * back at no more than the target frame rate, if any, and workers are told
+ * to lower the quality whenever a frame misses its deadline and to raise it
+ * again once there's slack.
+ * @child_comm: Communicator that spawned the worker processes
+ * @canvas: Canvas to draw onto
+ */
+static void receive_frames(MPI_Comm *child_comm, struct canvas *canvas)
+{
+    if (!g_opts.sequence) {
+        struct render_slice slice;
+        if (g_opts.share) {
+            int num_workers;
+            MPI_Check(MPI_Comm_remote_size(*child_comm, &num_workers));
+            open_slice(&slice, num_workers);
+        }
+        receive_pixels(child_comm, canvas, g_opts.share ? &slice : NULL);
+        if (g_opts.share)
+            close_slice(&slice);
+        return;
+    }
+
+    int num_frames, num_workers;
+    MPI_Check(MPI_Bcast(&num_frames, 1, MPI_INT, 0, *child_comm));
+    MPI_Check(MPI_Comm_remote_size(*child_comm, &num_workers));
+
+    double start = MPI_Wtime(), last = start, slowest = 0.0;
+    double budget = g_opts.fps > 0.0 ? 1.0 / g_opts.fps : 0.0;
+    int quality = QUALITY_FULL, num_updates = 0, slack_frames = 0;
+    int num_degraded = 0;
+    size_t num_pixels = 0;
+    unsigned long long num_allocs = g_num_allocs;
+    for (int frame = 0; frame < num_frames; frame++) {
+        num_pixels += receive_pixels(child_comm, canvas, NULL);
+        num_degraded += quality != QUALITY_FULL;
+        if (!frame)
+            num_allocs = g_num_allocs;
+
+        /* The first renderer speaks for all of them. */
+        double now = MPI_Wtime(), latency = now - last;
+        if (budget > 0.0 && g_rank == 0) {
+            int level = quality;
+            if (latency > budget) {
+                level = min(level + 1, QUALITY_MAX);
+                slack_frames = 0;
+            } else if (latency < budget * QUALITY_SLACK) {
+                if (++slack_frames == QUALITY_UPGRADE_FRAMES) {
+                    level = level > QUALITY_FULL ? level - 1 : level;
+                    slack_frames = 0;
+                }
+            } else {
+                slack_frames = 0;
+            }
+
+            if (level != quality) {
+                quality = level;
+                for (int w = 0; w < num_workers; w++) {
+                    MPI_Check(MPI_Send(
+                        &quality, 1, MPI_INT, w, TAG_QUALITY, *child_comm));
+                }
+                num_updates++;
+            }
+        }
+
+        if (budget > 0.0) {
+            double deadline = start + (frame + 1) * budget;
+            if (now < deadline) {
+                sleep_ms((int)((deadline - now) * 1e3));
+                now = MPI_Wtime();
+            }
+        }
+
+        slowest = latency > slowest ? latency : slowest;
+        last = now;
+    }
+    MPI_Check(MPI_Bcast(&num_updates, 1, MPI_INT,
+        g_rank == 0 ? MPI_ROOT : MPI_PROC_NULL, *child_comm));
+
+    /* The first renderer counts the workers' allocations as well. */
+    unsigned long long worker_allocs = 0;
+    MPI_Check(MPI_Reduce(NULL, &worker_allocs, 1, MPI_UNSIGNED_LONG_LONG,
+        MPI_SUM, g_rank == 0 ? MPI_ROOT : MPI_PROC_NULL, *child_comm));
+
+    double elapsed = MPI_Wtime() - start;
+    logf("%d frames in %.3f s: %.1f fps, slowest frame %.1f ms, %zu pixels "
+         "sent, %d frames degraded, %llu buffers allocated after the first "
+         "frame",
+        num_frames, elapsed, num_frames / elapsed, slowest * 1e3, num_pixels,
+        num_degraded, g_num_allocs - num_allocs + worker_allocs);
+}
+
+#ifndef _WIN32
+static int parse_filters(const char *str, struct filter_chain *chain);
+static struct lut3d *parse_cube_file(const char *path);
+
+/* Has the workers re-filter their rows with a new filter chain and draws the
+ * tiles that changed.
+ * @child_comm: Communicator that spawned the worker processes
+ * @canvas: Canvas to draw onto
+ * @filters: New filter string
+ */
+static void change_filters(MPI_Comm *child_comm, struct canvas *canvas,
+    char *filters)
+{
+    /* Don't let workers choke on an invalid chain or an unreadable LUT. */
+    struct filter_chain chain;
+    if (parse_filters(filters, &chain) < 0)
+        return;
+    for (size_t i = 0; i < chain.len; i++) {
+        char path[FILENAME_MAX];
+        const struct filter *f = &chain.stages[i];
+        if (f->op != 'u')
+            continue;
+
+        snprintf(path, sizeof(path), "%.*s", f->path_len, f->path);
+        struct lut3d *lut = parse_cube_file(path);
+        if (!lut) {
+            errf("ignoring filters `%s'", filters);
+            return;
+        }
+        free(lut->entries);
+        free(lut);
+    }
+
+    double start = MPI_Wtime();
+    int command = CMD_FILTERS, len = (int)strlen(filters);
+    MPI_Check(MPI_Bcast(&command, 1, MPI_INT, MPI_ROOT, *child_comm));
+    MPI_Check(MPI_Bcast(&len, 1, MPI_INT, MPI_ROOT, *child_comm));
+    MPI_Check(MPI_Bcast(filters, len + 1, MPI_CHAR, MPI_ROOT, *child_comm));
+
+    size_t num_pixels = receive_pixels(child_comm, canvas, NULL);
+    logf("filters `%s': redrew %zu pixels in %.1f ms", filters, num_pixels,
+        (MPI_Wtime() - start) * 1e3);
+}
+
+/* Reads filter strings, one per line, from the control FIFO and applies
+ * them.
+ * @fd: Control FIFO
+ * @line: Line buffer, BUFSIZ bytes long
+ * @line_len: Length of the partial line in the line buffer
+ * @child_comm: Communicator that spawned the worker processes
+ * @canvas: Canvas to draw onto
+ */
+static void read_control(int fd, char *line, size_t *line_len,
+    MPI_Comm *child_comm, struct canvas *canvas)
+{
+    ssize_t len;
+    while ((len = read(fd, line + *line_len, BUFSIZ - 1 - *line_len)) > 0) {
+        *line_len += len;
+
+        char *end;
+        while ((end = memchr(line, '\n', *line_len))) {
+            *end = '\0';
+            change_filters(child_comm, canvas, line);
+            *line_len -= end + 1 - line;
+            memmove(line, end + 1, *line_len);
+        }
+
+        if (*line_len == BUFSIZ - 1) {
+            errf("control line too long, ignoring");
+            *line_len = 0;
+        }
+    }
+}
+
+/* Part of the input shown in browse mode, and the bands of TILE_SIZE rows
+ * around it the renderer has cached. */
+struct viewport {
+    int top, num_rows;
+    int num_pending; /* workers yet to answer the last request */
+    int bands[VIEW_CACHE_BANDS]; /* -1 if the slot is free */
+    int heights[VIEW_CACHE_BANDS];
+    uint64_t last_used[VIEW_CACHE_BANDS], clock;
+    uint8_t *pixels; /* VIEW_CACHE_BANDS bands of TILE_SIZE rows */
+    uint8_t *msg; /* room for a tile message */
+};
+
+/* Finds a band of rows in the renderer's tile cache, marking it as used.
+ * Returns the cache slot holding the band, or -1 if it's not cached
+ * @view: Viewport
+ * @band: Band index
+ */
+static int find_band(struct viewport *view, int band)
+{
+    for (int i = 0; i < VIEW_CACHE_BANDS; i++) {
+        if (view->bands[i] == band) {
+            view->last_used[i] = ++view->clock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Stores a band of rows sent by a worker in the renderer's tile cache,
+ * evicting the least recently used one if the cache is full.
+ * @view: Viewport
+ * @tile: Full-width tile holding the band
+ * @pixels: Packed RGB triplets
+ */
+static void cache_band(struct viewport *view, const struct tile_header *tile,
+    const uint8_t *pixels)
+{
+    int slot = 0;
+    for (int i = 1; i < VIEW_CACHE_BANDS; i++) {
+        if (view->last_used[i] < view->last_used[slot])
+            slot = i;
+    }
+
+    view->bands[slot] = tile->y / TILE_SIZE;
+    view->heights[slot] = tile->h;
+    view->last_used[slot] = ++view->clock;
+    memcpy(view->pixels + (size_t)slot * TILE_SIZE * BITMAP_STRIDE, pixels,
+        (size_t)tile->h * BITMAP_STRIDE);
+}
+
+/* Receives the bands of rows requested by the last call to request_bands()
+ * into the tile cache.
+ * @child_comm: Communicator that spawned the worker processes
+ * @view: Viewport
+ * @wait: Whether to wait for every band, rather than just take those that
+ * already arrived
+ */
+static void receive_bands(MPI_Comm *child_comm, struct viewport *view,
+    int wait)
+{
+    while (view->num_pending) {
+        MPI_Status status;
+        int pending, len;
+        MPI_Check(MPI_Iprobe(
+            MPI_ANY_SOURCE, MPI_ANY_TAG, *child_comm, &pending, &status));
+        if (!pending) {
+            if (!wait)
+                return;
+            MPI_Check(MPI_Probe(
+                MPI_ANY_SOURCE, MPI_ANY_TAG, *child_comm, &status));
+        }
+
+        if (status.MPI_TAG == TAG_DONE) {
+            MPI_Check(MPI_Recv(NULL, 0, MPI_BYTE, status.MPI_SOURCE,
+                TAG_DONE, *child_comm, MPI_STATUS_IGNORE));
+            view->num_pending--;
+            continue;
+        }
+
+        MPI_Check(MPI_Get_count(&status, MPI_BYTE, &len));
+        if ((size_t)len > TILE_MSG_MAX) {
+            errf("tile message of %d bytes is too long", len);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            MPI_Finalize();
+            _exit(EXIT_FAILURE);
+        }
+        MPI_Check(MPI_Recv(view->msg, len, MPI_BYTE, status.MPI_SOURCE,
+            TAG_TILE, *child_comm, MPI_STATUS_IGNORE));
+        const struct tile_header *tile = (const struct tile_header *)view->msg;
+        cache_band(view, tile, view->msg + sizeof(*tile));
+    }
+}
+
+/* Asks the workers for the bands of rows in a range that aren't cached
+ * yet, once the previous request is through.
+ * Returns the number of bands requested
+ * @child_comm: Communicator that spawned the worker processes
+ * @view: Viewport
+ * @first: First band
+ * @last: Last band
+ */
+static int request_bands(MPI_Comm *child_comm, struct viewport *view,
+    int first, int last)
+{
+    receive_bands(child_comm, view, 1);
+
+    int bands[VIEW_CACHE_BANDS], num_bands = 0;
+    first = first > 0 ? first : 0;
+    last = min(last, (view->num_rows - 1) / TILE_SIZE);
+    for (int band = first; band <= last; band++) {
+        if (find_band(view, band) < 0)
+            bands[num_bands++] = band;
+    }
+    if (!num_bands)
+        return 0;
+
+    int command = CMD_VIEW;
+    MPI_Check(MPI_Bcast(&command, 1, MPI_INT, MPI_ROOT, *child_comm));
+    MPI_Check(MPI_Bcast(&num_bands, 1, MPI_INT, MPI_ROOT, *child_comm));
+    MPI_Check(MPI_Bcast(bands, num_bands, MPI_INT, MPI_ROOT, *child_comm));
+    MPI_Check(MPI_Comm_remote_size(*child_comm, &view->num_pending));
+    return num_bands;
+}
+
+/* Scrolls the viewport to a row, drawing the bands of rows in sight from
+ * the tile cache and fetching those that are missing. The bands just past
+ * the viewport in the direction it moved get prefetched in the background.
+ * @child_comm: Communicator that spawned the worker processes
+ * @canvas: Canvas to draw onto
+ * @view: Viewport
+ * @top: Row to show at the top of the window
+ */
+static void show_view(MPI_Comm *child_comm, struct canvas *canvas,
+    struct viewport *view, int top)
+{
+    top = min(top, view->num_rows - BITMAP_HEIGHT);
+    top = top > 0 ? top : 0;
+    int down = top >= view->top;
+    view->top = top;
+
+    double start = MPI_Wtime();
+    int first = top / TILE_SIZE,
+        last = min(top + BITMAP_HEIGHT, view->num_rows) - 1;
+    last /= TILE_SIZE;
+    int num_fetched = request_bands(child_comm, view, first, last);
+    receive_bands(child_comm, view, 1);
+
+    for (int band = first; band <= last; band++) {
+        int slot = find_band(view, band);
+        if (slot < 0)
+            continue;
+        const uint8_t *pixels
+            = view->pixels + (size_t)slot * TILE_SIZE * BITMAP_STRIDE;
+        struct tile_header tile
+            = { 0, 0, BITMAP_WIDTH, (uint16_t)view->heights[slot], 0 };
+
+        /* Clip the band to the top of the window. */
+        int y = band * TILE_SIZE - top;
+        if (y < 0) {
+            pixels += (size_t)-y * BITMAP_STRIDE;
+            tile.h = (uint16_t)(tile.h + y);
+        } else {
+            tile.y = (uint16_t)y;
+        }
+        canvas_draw_tile(canvas, &tile, pixels);
+    }
+    canvas_flush(canvas);
+    logf("showing rows %d-%d, fetched %d bands in %.1f ms", top,
+        min(top + BITMAP_HEIGHT, view->num_rows) - 1, num_fetched,
+        (MPI_Wtime() - start) * 1e3);
+
+    if (down) {
+        request_bands(child_comm, view, last + 1, last + VIEW_PREFETCH_BANDS);
+    } else {
+        request_bands(
+            child_comm, view, first - VIEW_PREFETCH_BANDS, first - 1);
+    }
+}
+
+/* Scrolls the viewport as told by a key press.
+ * @child_comm: Communicator that spawned the worker processes
+ * @canvas: Canvas to draw onto
+ * @view: Viewport
+ * @key: Key pressed
+ */
+static void scroll_view(MPI_Comm *child_comm, struct canvas *canvas,
+    struct viewport *view, KeySym key)
+{
+    switch (key) {
+    case XK_Up:
+        show_view(child_comm, canvas, view, view->top - TILE_SIZE);
+        break;
+    case XK_Down:
+        show_view(child_comm, canvas, view, view->top + TILE_SIZE);
+        break;
+    case XK_Page_Up:
+        show_view(child_comm, canvas, view, view->top - BITMAP_HEIGHT);
+        break;
+    case XK_Page_Down:
+        show_view(child_comm, canvas, view, view->top + BITMAP_HEIGHT);
+        break;
+    case XK_Home:
+        show_view(child_comm, canvas, view, 0);
+        break;
+    case XK_End:
+        show_view(child_comm, canvas, view, view->num_rows);
+        break;
+    }
+}
+
+/* Handles input file changes, control commands and key presses until the
+ * window gets closed.
+ * @child_comm: Communicator that spawned the worker processes
+ * @canvas: Canvas to draw onto
+ */
+static void run_event_loop(MPI_Comm *child_comm, struct canvas *canvas)
+{
+    int watch_fd = -1, control_fd = -1;
+    if (g_opts.watch) {
+        watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd < 0
+            || inotify_add_watch(
+                   watch_fd, g_opts.input_path, IN_MODIFY | IN_CLOSE_WRITE)
+                < 0) {
+            errf("could not watch `%s': %s", g_opts.input_path,
+                strerror(errno));
+            if (watch_fd >= 0)
+                close(watch_fd);
+            watch_fd = -1;
+        }
+    }
+
+    /* Keep the FIFO open for writing as well, so that it doesn't hang up
+     * whenever a writer goes away. */
+    if (g_opts.control_path) {
+        control_fd = open(g_opts.control_path, O_RDWR | O_NONBLOCK);
+        if (control_fd < 0) {
+            errf("could not open `%s': %s", g_opts.control_path,
+                strerror(errno));
+        }
+    }
+
+    struct pollfd fds[3] = {
+        { watch_fd, POLLIN, 0 },
+        { control_fd, POLLIN, 0 },
+        { ConnectionNumber(canvas->display), POLLIN, 0 },
+    };
+    char line[BUFSIZ];
+    size_t line_len = 0;
+    double first_change = 0.0, last_change = 0.0;
+    int command = CMD_REFRESH;
+
+    struct viewport view = { 0 };
+    if (g_opts.browse) {
+        MPI_Check(MPI_Bcast(&view.num_rows, 1, MPI_INT, 0, *child_comm));
+        for (int i = 0; i < VIEW_CACHE_BANDS; i++)
+            view.bands[i] = -1;
+        view.pixels = alloc_buffer(
+            (size_t)VIEW_CACHE_BANDS * TILE_SIZE * BITMAP_STRIDE);
+        view.msg = alloc_buffer(TILE_MSG_MAX);
+        show_view(child_comm, canvas, &view, 0);
+    }
+
+    while (command != CMD_QUIT) {
+        /* Let writes settle down before refreshing, but not forever if the
+         * producer keeps on writing. Keep an eye on prefetched bands. */
+        int timeout = first_change > 0.0 ? WATCH_SETTLE_MS : WATCH_POLL_MS;
+        if (view.num_pending) {
+            receive_bands(child_comm, &view, 0);
+            timeout = view.num_pending ? VIEW_POLL_MS : timeout;
+        }
+        if (poll(fds, 3, timeout) < 0 && errno != EINTR) {
+            errf("could not poll for events: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char events[4096];
+            while (read(watch_fd, events, sizeof(events)) > 0)
+                ;
+
+            last_change = MPI_Wtime();
+            if (first_change == 0.0)
+                first_change = last_change;
+        }
+
+        if (fds[1].revents & POLLIN)
+            read_control(control_fd, line, &line_len, child_comm, canvas);
+
+        double now = MPI_Wtime();
+        if (first_change > 0.0
+            && (now - last_change >= WATCH_SETTLE_MS / 1e3
+                || now - first_change >= WATCH_MAX_DELAY_MS / 1e3)) {
+            MPI_Check(MPI_Bcast(&command, 1, MPI_INT, MPI_ROOT, *child_comm));
+            size_t num_pixels = receive_pixels(child_comm, canvas, NULL);
+            logf("refreshed %zu pixels in %.1f ms", num_pixels,
+                (MPI_Wtime() - now) * 1e3);
+            first_change = 0.0;
+        }
+
+        while (XPending(canvas->display)) {
+            XEvent event;
+            XNextEvent(canvas->display, &event);
+            if (event.type == ClientMessage) {
+                command = CMD_QUIT;
+            } else if (event.type == KeyPress) {
+                KeySym key = XLookupKeysym(&event.xkey, 0);
+                if (g_opts.browse)
+                    scroll_view(child_comm, canvas, &view, key);
+                for (size_t i = 0; i < g_opts.num_bindings; i++) {
+                    if (key == (KeySym)g_opts.bindings[i].key) {
+                        change_filters(
+                            child_comm, canvas, g_opts.bindings[i].filters);
+                    }
+                }
+            }
+        }
+    }
+
+    /* Let the workers go. */
+    if (g_opts.browse) {
+        receive_bands(child_comm, &view, 1);
+        free_buffer(view.pixels);
+        free_buffer(view.msg);
+    }
+    command = CMD_QUIT;
+    MPI_Check(MPI_Bcast(&command, 1, MPI_INT, MPI_ROOT, *child_comm));
+    if (watch_fd >= 0)
+        close(watch_fd);
+    if (control_fd >= 0)
+        close(control_fd);
+}
+
+/* Opens the window showing the rows of the canvas between its top and
+ * bottom, and wraps its framebuffer in an XImage.
+ * Returns -1 if the display could not be opened, 0 on success
+ * @canvas: Canvas, whose framebuffer must be allocated already
+ */
+static int open_window(struct canvas *canvas)
+{
+    /* Open display. */
+    const char *display_name = getenv("DISPLAY");
+    Display *display = XOpenDisplay(display_name);
+    if (!display) {
+        errf("could not open display: %s", display_name);
+        return -1;
+    }
+
+    /* Create window. */
+    int screen_num = DefaultScreen(display);
+    Window window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0,
+        0, BITMAP_WIDTH, canvas->bottom - canvas->top, 0,
+        BlackPixel(display, screen_num), BlackPixel(display, screen_num));
+    GC ctx = XCreateGC(display, window, 0, NULL);
+    XSelectInput(display, window,
+        g_opts.num_bindings || g_opts.browse ? KeyPressMask : 0);
+    XMapWindow(display, window);
+    XFlush(display);
+
+    canvas->display = display;
+    canvas->window = window;
+    canvas->ctx = ctx;
+    canvas->image = XCreateImage(display, DefaultVisual(display, screen_num),
+        DefaultDepth(display, screen_num), ZPixmap, 0, (char *)canvas->pixels,
+        BITMAP_WIDTH, BITMAP_HEIGHT, 32, 0);
+    return 0;
+}
+
+/* Blocks until the window gets closed.
+ * @canvas: Canvas
+ */
+static void wait_for_close(struct canvas *canvas)
+{
+    XEvent event;
+    do {
+        XNextEvent(canvas->display, &event);
+    } while (event.type != ClientMessage);
+}
+
+/* Closes the window, freeing the framebuffer along with it.
+ * @canvas: Canvas
+ */
+static void close_window(struct canvas *canvas)
+{
+    /* Keep XDestroyImage() from freeing the framebuffer itself. */
+    canvas->image->data = NULL;
+    XDestroyImage(canvas->image);
+    free_buffer(canvas->pixels);
+    XDestroyWindow(canvas->display, canvas->window);
+    XCloseDisplay(canvas->display);
+}
+#endif
+
+/* Waits for incoming data from other peers in the network and renders the
+ * received pixels to an X11 window.
+ * @child_comm: Communicator that spawned the worker processes
+ */
+static void perform_rendering(MPI_Comm *child_comm)
+{
+    struct canvas canvas;
+#ifdef _WIN32
+    HINSTANCE hInstance = GetModuleHandle(NULL);
+
+    /* Register window class. */
+    LPCSTR szClassName = PROGNAME;
+    WNDCLASSEX WndClassEx;
+    WndClassEx.cbSize = sizeof(WNDCLASSEX);
+    WndClassEx.style = 0;
+    WndClassEx.lpfnWndProc = DefWindowProc;
+    WndClassEx.cbClsExtra = 0;
+    WndClassEx.cbWndExtra = 0;
+    WndClassEx.hInstance = hInstance;
+    WndClassEx.hIcon = LoadIcon(NULL, IDI_APPLICATION);
+    WndClassEx.hCursor = LoadCursor(NULL, IDC_ARROW);
+    WndClassEx.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
+    WndClassEx.lpszMenuName = NULL;
+    WndClassEx.lpszClassName = szClassName;
+    WndClassEx.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
+
+    if (!RegisterClassEx(&WndClassEx)) {
+        errf("window registration failed (%08x)", GetLastError());
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+        return 0;
+    }
+
+    /* Create window. */
+    HWND hWnd = CreateWindowEx(WS_EX_CLIENTEDGE, szClassName, PROGNAME,
+        WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, BITMAP_WIDTH,
+        BITMAP_HEIGHT, NULL, NULL, hInstance, NULL);
+    if (!hWnd) {
+        errf("window creation failed (%08x)", GetLastError());
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+
+    ShowWindow(hWnd, SW_SHOW);
+    UpdateWindow(hWnd);
+
+    /* Draw bitmap. */
+    canvas.hDC = GetDC(hWnd);
+    receive_frames(child_comm, &canvas);
+    ReleaseDC(hWnd, canvas.hDC);
+    DeleteDC(canvas.hDC);
+
+    /* Window event loop. */
+    MSG Msg;
+    while (GetMessage(&Msg, NULL, 0, 0) > 0) {
+        TranslateMessage(&Msg);
+        DispatchMessage(&Msg);
+    }
+#else
+    /* Receive pixels into a framebuffer, of which we only show our own
+     * rows. */
+    memset(&canvas, 0, sizeof(canvas));
+    canvas.pixels = alloc_buffer(CANVAS_BYTES);
+    memset(canvas.pixels, 0, CANVAS_BYTES);
+    renderer_rows(g_rank, g_size, &canvas.top, &canvas.bottom);
+    if (g_opts.headless) {
+        receive_frames(child_comm, &canvas);
+        free_buffer(canvas.pixels);
+        return;
+    }
+
+    if (open_window(&canvas)) {
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+    if (!g_opts.browse)
+        receive_frames(child_comm, &canvas);
+
+    if (g_opts.keep_alive)
+        run_event_loop(child_comm, &canvas);
+    else
+        wait_for_close(&canvas);
+    close_window(&canvas);
+#endif
+}
+
+/* Fixed point precision of the colour matrix kernel. The constant column is
+ * fed through a lane holding COLOR_MATRIX_ONE. */
+#define COLOR_MATRIX_SHIFT 10
+#define COLOR_MATRIX_ONE 64
+
+/* Builds the 3x4 affine colour matrix of a cross-channel filter.
+ * @f: Filter stage
+ * @m: Output matrix
+ */
+static void color_matrix_for(const struct filter *f, double m[12])
+{
+    /* Luma weights used for saturation and hue rotation. */
+    const double lr = 0.213, lg = 0.715, lb = 0.072;
+    double c, s;
+
+    memset(m, 0, 12 * sizeof(double));
+    switch (f->op) {
+    /* Grayscale, lighten and darken have always truncated. Their offsets are
+     * nudged down by less than half a level so that rounding gives the same
+     * results, exactly so in the fixed point kernel. */
+    case 'g': /* grayscale */
+        for (int i = 0; i < 12; i++)
+            m[i] = i % 4 == 3 ? -0.1875 : 1.0 / 3.0;
+        break;
+    case 'l': /* lighten */
+        m[0] = m[5] = m[10] = 0.75;
+        m[3] = m[7] = m[11] = 255.0 * 0.25 - 0.375;
+        break;
+    case 'd': /* darken */
+        m[0] = m[5] = m[10] = 0.75;
+        m[3] = m[7] = m[11] = -0.375;
+        break;
+    case 'i': /* invert */
+        m[0] = m[5] = m[10] = -1.0;
+        m[3] = m[7] = m[11] = 255.0;
+        break;
+    case 's': /* sepia */
+        m[0] = 0.393, m[1] = 0.769, m[2] = 0.189;
+        m[4] = 0.349, m[5] = 0.686, m[6] = 0.168;
+        m[8] = 0.272, m[9] = 0.534, m[10] = 0.131;
+        break;
+    case 'S': /* saturation */
+        s = f->args[0];
+        m[0] = lr + (1 - lr) * s, m[1] = lg - lg * s, m[2] = lb - lb * s;
+        m[4] = lr - lr * s, m[5] = lg + (1 - lg) * s, m[6] = lb - lb * s;
+        m[8] = lr - lr * s, m[9] = lg - lg * s, m[10] = lb + (1 - lb) * s;
+        break;
+    case 'h': /* hue rotation */
+        c = cos(f->args[0] * 3.14159265358979323846 / 180.0);
+        s = sin(f->args[0] * 3.14159265358979323846 / 180.0);
+        m[0] = lr + c * (1 - lr) - s * lr;
+        m[1] = lg - c * lg - s * lg;
+        m[2] = lb - c * lb + s * (1 - lb);
+        m[4] = lr - c * lr + s * 0.143;
+        m[5] = lg + c * (1 - lg) + s * 0.140;
+        m[6] = lb - c * lb - s * 0.283;
+        m[8] = lr - c * lr - s * (1 - lr);
+        m[9] = lg - c * lg + s * lg;
+        m[10] = lb + c * (1 - lb) + s * lb;
+        break;
+    case 'x': /* channel swap */
+        for (int i = 0; i < 3; i++)
+            m[i * 4 + (int)f->args[i]] = 1.0;
+        break;
+    case 'y': /* RGB to YCbCr (BT.601, full range) */
+        m[0] = 0.299, m[1] = 0.587, m[2] = 0.114;
+        m[4] = -0.168736, m[5] = -0.331264, m[6] = 0.5, m[7] = 128.0;
+        m[8] = 0.5, m[9] = -0.418688, m[10] = -0.081312, m[11] = 128.0;
+        break;
+    case 'Y': /* YCbCr to RGB */
+        m[0] = 1.0, m[2] = 1.402, m[3] = -1.402 * 128.0;
+        m[4] = 1.0, m[5] = -0.344136, m[6] = -0.714136;
+        m[7] = (0.344136 + 0.714136) * 128.0;
+        m[8] = 1.0, m[9] = 1.772, m[11] = -1.772 * 128.0;
+        break;
+    case 'm': /* user-supplied matrix */
+        memcpy(m, f->args, 12 * sizeof(double));
+        break;
+    }
+}
+
+/* Folds two colour matrices into one.
+ * @first: Matrix applied first, replaced by the result
+ * @then: Matrix applied afterwards
+ */
+static void compose_color_matrices(double first[12], const double then[12])
+{
+    double res[12];
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 4; col++) {
+            double v = col == 3 ? then[row * 4 + 3] : 0.0;
+            for (int k = 0; k < 3; k++)
+                v += then[row * 4 + k] * first[k * 4 + col];
+            res[row * 4 + col] = v;
+        }
+    }
+    memcpy(first, res, sizeof(res));
+}
+
+/* Applies a colour matrix to a buffer of packed RGB triplets.
+ * Matrices whose coefficients fit the fixed point representation go through
+ * the integer (SIMD) kernel; anything else falls back to floating point.
+ * @buf: Pixel data
+ * @num_pixels: Number of pixels in the buffer
+ * @m: Colour matrix
+ */
+static void apply_color_matrix(uint8_t *buf, size_t num_pixels,
+    const double m[12])
+{
+    int16_t coef[12];
+    int fits = 1;
+    for (int i = 0; i < 12; i++) {
+        double v = m[i] * (1 << COLOR_MATRIX_SHIFT);
+        if (i % 4 == 3)
+            v /= COLOR_MATRIX_ONE;
+        v = floor(v + 0.5);
+        fits &= v >= INT16_MIN && v <= INT16_MAX;
+        coef[i] = fits ? (int16_t)v : 0;
+    }
+
+    if (!fits) {
+        for (size_t off = 0; off < num_pixels; off++) {
+            uint8_t *p = buf + off * BITMAP_BPP;
+            double in[3] = { p[0], p[1], p[2] };
+            for (int c = 0; c < 3; c++) {
+                double v = m[c * 4] * in[0] + m[c * 4 + 1] * in[1]
+                    + m[c * 4 + 2] * in[2] + m[c * 4 + 3] + 0.5;
+                p[c] = v < 0.0 ? 0 : v > 255.0 ? 255 : (uint8_t)v;
+            }
+        }
+        return;
+    }
+
+    size_t off = 0;
+#ifdef HAVE_SSE2
+    /* Pixels are widened to (r, g, b, 1) lanes so that each output channel
+     * takes two multiply-adds per pair of pixels. */
+    __m128i rows[3];
+    for (int c = 0; c < 3; c++) {
+        rows[c] = _mm_set_epi16(coef[c * 4 + 3], coef[c * 4 + 2],
+            coef[c * 4 + 1], coef[c * 4], coef[c * 4 + 3], coef[c * 4 + 2],
+            coef[c * 4 + 1], coef[c * 4]);
+    }
+    const __m128i zero = _mm_setzero_si128(),
+                  round = _mm_set1_epi32(1 << (COLOR_MATRIX_SHIFT - 1)),
+                  one = _mm_set1_epi32(COLOR_MATRIX_ONE << 24);
+
+    for (; off + 4 <= num_pixels; off += 4) {
+        uint8_t *p = buf + off * BITMAP_BPP;
+        __m128i px = _mm_set_epi32(p[9] | p[10] << 8 | p[11] << 16,
+            p[6] | p[7] << 8 | p[8] << 16, p[3] | p[4] << 8 | p[5] << 16,
+            p[0] | p[1] << 8 | p[2] << 16);
+        px = _mm_or_si128(px, one);
+        __m128i lo = _mm_unpacklo_epi8(px, zero),
+                hi = _mm_unpackhi_epi8(px, zero);
+
+        __m128i res[3];
+        for (int c = 0; c < 3; c++) {
+            __m128 a = _mm_castsi128_ps(_mm_madd_epi16(lo, rows[c]));
+            __m128 b = _mm_castsi128_ps(_mm_madd_epi16(hi, rows[c]));
+            __m128i even = _mm_castps_si128(
+                _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i odd = _mm_castps_si128(
+                _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+            res[c] = _mm_srai_epi32(
+                _mm_add_epi32(_mm_add_epi32(even, odd), round),
+                COLOR_MATRIX_SHIFT);
+        }
+
+        /* Saturate to bytes: r0..r3 g0..g3 b0..b3. */
+        uint8_t out[16];
+        _mm_storeu_si128((__m128i *)out,
+            _mm_packus_epi16(_mm_packs_epi32(res[0], res[1]),
+                _mm_packs_epi32(res[2], zero)));
+        for (int j = 0; j < 4; j++) {
+            p[j * BITMAP_BPP + 0] = out[j];
+            p[j * BITMAP_BPP + 1] = out[4 + j];
+            p[j * BITMAP_BPP + 2] = out[8 + j];
+        }
+    }
+#endif
+
+    for (; off < num_pixels; off++) {
+        uint8_t *p = buf + off * BITMAP_BPP;
+        int32_t in[3] = { p[0], p[1], p[2] };
+        for (int c = 0; c < 3; c++) {
+            int32_t v = (coef[c * 4] * in[0] + coef[c * 4 + 1] * in[1]
+                            + coef[c * 4 + 2] * in[2]
+                            + coef[c * 4 + 3] * COLOR_MATRIX_ONE
+                            + (1 << (COLOR_MATRIX_SHIFT - 1)))
+                >> COLOR_MATRIX_SHIFT;
+            p[c] = v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+        }
+    }
+}
+
+/* Largest supported 3D LUT edge length; a 65^3 table of packed entries
+ * takes 1.1 MiB and so mostly stays in cache while it is applied. */
+#define LUT3D_MAX_SIZE 65
+
+/* Works out the lattice cell of every input level and where in the cell it
+ * falls, once per table rather than every time it is applied.
+ * @lut: 3D LUT, whose size and domain are known
+ */
+static void index_lut3d(struct lut3d *lut)
+{
+    int n = lut->size;
+    for (int c = 0; c < 3; c++) {
+        double scale = (n - 1) / (lut->domain_max[c] - lut->domain_min[c]);
+        for (int v = 0; v < 256; v++) {
+            double pos = (v / 255.0 - lut->domain_min[c]) * scale;
+            pos = pos < 0.0 ? 0.0 : pos > n - 1 ? n - 1 : pos;
+            lut->cell[c][v] = pos >= n - 1 ? n - 2 : (int)pos;
+            lut->frac[c][v] = (float)(pos - lut->cell[c][v]);
+        }
+    }
+}
+
+/* Parses an Adobe/Resolve `.cube' 3D LUT file.
+ * Returns NULL on failure, the newly allocated table on success
+ * @path: Path to the LUT file
+ */
+static struct lut3d *parse_cube_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        errf("could not open LUT `%s': %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct lut3d *lut = calloc(1, sizeof(*lut));
+    size_t num_entries = 0, count = 0;
+    char line[BUFSIZ];
+
+    if (!lut) {
+        errf("out of memory loading LUT `%s'", path);
+        fclose(file);
+        return NULL;
+    }
+    for (int c = 0; c < 3; c++)
+        lut->domain_max[c] = 1.0;
+
+    while (fgets(line, sizeof(line), file)) {
+        double r, g, b;
+        if (line[0] == '#' || !strncmp(line, "TITLE", 5)) {
+            continue;
+        } else if (!strncmp(line, "LUT_3D_SIZE", 11)) {
+            lut->size = atoi(line + 11);
+            if (lut->size < 2 || lut->size > LUT3D_MAX_SIZE || lut->entries)
+                break;
+            num_entries = (size_t)lut->size * lut->size * lut->size;
+            lut->entries = malloc(num_entries * sizeof(uint32_t));
+            if (!lut->entries) {
+                errf("out of memory loading LUT `%s'", path);
+                num_entries = 0;
+                break;
+            }
+        } else if (!strncmp(line, "LUT_1D_SIZE", 11)) {
+            break;
+        } else if (sscanf(line, "DOMAIN_MIN %lf %lf %lf", &r, &g, &b) == 3) {
+            lut->domain_min[0] = r, lut->domain_min[1] = g;
+            lut->domain_min[2] = b;
+        } else if (sscanf(line, "DOMAIN_MAX %lf %lf %lf", &r, &g, &b) == 3) {
+            lut->domain_max[0] = r, lut->domain_max[1] = g;
+            lut->domain_max[2] = b;
+        } else if (sscanf(line, "%lf %lf %lf", &r, &g, &b) == 3) {
+            if (count == num_entries)
+                break;
+
+            double in[3] = { r, g, b };
+            uint32_t entry = 0;
+            for (int c = 0; c < 3; c++) {
+                double v = in[c] < 0.0 ? 0.0 : in[c] > 1.0 ? 1.0 : in[c];
+                entry |= (uint32_t)(v * 1023.0 + 0.5) << (10 * c);
+            }
+            lut->entries[count++] = entry;
+        }
+    }
+
+    fclose(file);
+
+    /* An empty domain would scale inputs by infinity. */
+    int empty_domain = 0;
+    for (int c = 0; c < 3; c++)
+        empty_domain |= !(lut->domain_max[c] > lut->domain_min[c]);
+
+    if (!num_entries || count != num_entries || empty_domain) {
+        errf("invalid or unsupported 3D LUT `%s'", path);
+        free(lut->entries);
+        free(lut);
+        return NULL;
+    }
+
+    index_lut3d(lut);
+    return lut;
+}
+
+/* Loads a 3D LUT on the first worker and broadcasts it to every other one.
+ * This is a collective operation.
+ * Returns NULL on failure, the newly allocated table on success
+ * @f: LUT filter stage
+ */
+static struct lut3d *load_lut3d(const struct filter *f)
+{
+    char path[FILENAME_MAX];
+    struct lut3d *lut = NULL;
+    int size = 0;
+
+    snprintf(path, sizeof(path), "%.*s", f->path_len, f->path);
+    if (g_rank == 0) {
+        logf("loading 3D LUT `%s'", path);
+        lut = parse_cube_file(path);
+        size = lut ? lut->size : 0;
+    }
+
+    MPI_Check(MPI_Bcast(&size, 1, MPI_INT, 0, MPI_COMM_WORLD));
+    if (!size)
+        return NULL;
+
+    int num_entries = size * size * size;
+    if (g_rank != 0) {
+        lut = calloc(1, sizeof(*lut));
+        if (!lut || !(lut->entries = malloc(num_entries * sizeof(uint32_t)))) {
+            errf("out of memory loading LUT `%s'", path);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            MPI_Finalize();
+            _exit(EXIT_FAILURE);
+        }
+        lut->size = size;
+    }
+
+    MPI_Check(MPI_Bcast(lut->domain_min, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD));
+    MPI_Check(MPI_Bcast(lut->domain_max, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD));
+    MPI_Check(MPI_Bcast(
+        lut->entries, num_entries, MPI_UINT32_T, 0, MPI_COMM_WORLD));
+    if (g_rank != 0)
+        index_lut3d(lut);
+    return lut;
+}
+
+/* Applies a 3D LUT to a buffer of packed RGB triplets using tetrahedral
+ * interpolation.
+ * @buf: Pixel data
+ * @num_pixels: Number of pixels in the buffer
+ * @lut: 3D LUT
+ */
+static void apply_lut3d(uint8_t *buf, size_t num_pixels,
+    const struct lut3d *lut)
+{
+    int n = lut->size;
+    const int(*cell)[256] = lut->cell;
+    const float(*frac)[256] = lut->frac;
+    const size_t strides[3] = { 1, (size_t)n, (size_t)n * n };
+    const uint32_t *entries = lut->entries;
+
+    size_t off = 0;
+#ifdef HAVE_SSE2
+    /* Four pixels at a time, one lane each. Sorting the fractions with
+     * min/max gives the weights of the tetrahedron without branching; only
+     * the corners it walks through depend on which axis is which. */
+    const __m128i stride_r = _mm_set1_epi32((int)strides[0]),
+                  stride_g = _mm_set1_epi32((int)strides[1]),
+                  stride_b = _mm_set1_epi32((int)strides[2]),
+                  stride_all = _mm_set1_epi32((int)(1 + n + n * n)),
+                  channel = _mm_set1_epi32(1023);
+    const __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f),
+                 unpack = _mm_set1_ps(255.0f / 1023.0f);
+
+    for (; off + 4 <= num_pixels; off += 4) {
+        uint8_t *p = buf + off * BITMAP_BPP;
+        __m128 fr = _mm_set_ps(frac[0][p[9]], frac[0][p[6]], frac[0][p[3]],
+            frac[0][p[0]]);
+        __m128 fg = _mm_set_ps(frac[1][p[10]], frac[1][p[7]], frac[1][p[4]],
+            frac[1][p[1]]);
+        __m128 fb = _mm_set_ps(frac[2][p[11]], frac[2][p[8]], frac[2][p[5]],
+            frac[2][p[2]]);
+
+        __m128 hi = _mm_max_ps(_mm_max_ps(fr, fg), fb),
+               lo = _mm_min_ps(_mm_min_ps(fr, fg), fb),
+               mid = _mm_max_ps(_mm_min_ps(fr, fg),
+                   _mm_min_ps(_mm_max_ps(fr, fg), fb));
+        __m128 w[4] = { _mm_sub_ps(one, hi), _mm_sub_ps(hi, mid),
+            _mm_sub_ps(mid, lo), lo };
+
+        /* The walk leaves the origin along the axis of the largest fraction
+         * and reaches the opposite corner along that of the smallest. Ties
+         * give the corners in between a weight of zero, so either axis
+         * does. */
+        __m128i r_hi = _mm_castps_si128(_mm_cmpeq_ps(fr, hi)),
+                g_hi = _mm_andnot_si128(
+                    r_hi, _mm_castps_si128(_mm_cmpeq_ps(fg, hi))),
+                b_lo = _mm_castps_si128(_mm_cmpeq_ps(fb, lo)),
+                g_lo = _mm_andnot_si128(
+                    b_lo, _mm_castps_si128(_mm_cmpeq_ps(fg, lo)));
+        __m128i corner1 = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(r_hi, stride_r),
+                _mm_and_si128(g_hi, stride_g)),
+            _mm_andnot_si128(_mm_or_si128(r_hi, g_hi), stride_b));
+        __m128i last = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(b_lo, stride_b),
+                _mm_and_si128(g_lo, stride_g)),
+            _mm_andnot_si128(_mm_or_si128(b_lo, g_lo), stride_r));
+        int32_t corners[2][4];
+        _mm_storeu_si128((__m128i *)corners[0], corner1);
+        _mm_storeu_si128(
+            (__m128i *)corners[1], _mm_sub_epi32(stride_all, last));
+
+        __m128i taps[4];
+        uint32_t t[4][4];
+        for (int j = 0; j < 4; j++) {
+            const uint8_t *q = p + j * BITMAP_BPP;
+            const uint32_t *base = entries + cell[0][q[0]] * strides[0]
+                + cell[1][q[1]] * strides[1] + cell[2][q[2]] * strides[2];
+            t[0][j] = base[0];
+            t[1][j] = base[corners[0][j]];
+            t[2][j] = base[corners[1][j]];
+            t[3][j] = base[strides[0] + strides[1] + strides[2]];
+        }
+        for (int k = 0; k < 4; k++)
+            taps[k] = _mm_loadu_si128((const __m128i *)t[k]);
+
+        __m128i res[3];
+        for (int c = 0; c < 3; c++) {
+            __m128 acc = _mm_setzero_ps();
+            for (int k = 0; k < 4; k++) {
+                __m128 v = _mm_cvtepi32_ps(_mm_and_si128(
+                    _mm_srli_epi32(taps[k], 10 * c), channel));
+                acc = _mm_add_ps(acc, _mm_mul_ps(v, w[k]));
+            }
+            /* Round halves up, as the scalar code does, rather than to
+             * even. */
+            res[c] = _mm_cvttps_epi32(
+                _mm_add_ps(_mm_mul_ps(acc, unpack), half));
+        }
+
+        /* Saturate to bytes: r0..r3 g0..g3 b0..b3. */
+        uint8_t out[16];
+        _mm_storeu_si128((__m128i *)out,
+            _mm_packus_epi16(_mm_packs_epi32(res[0], res[1]),
+                _mm_packs_epi32(res[2], _mm_setzero_si128())));
+        for (int j = 0; j < 4; j++) {
+            p[j * BITMAP_BPP + 0] = out[j];
+            p[j * BITMAP_BPP + 1] = out[4 + j];
+            p[j * BITMAP_BPP + 2] = out[8 + j];
+        }
+    }
+#endif
+
+    for (; off < num_pixels; off++) {
+        uint8_t *p = buf + off * BITMAP_BPP;
+        const uint32_t *base = entries + cell[0][p[0]] * strides[0]
+            + cell[1][p[1]] * strides[1] + cell[2][p[2]] * strides[2];
+        float f[3] = { frac[0][p[0]], frac[1][p[1]], frac[2][p[2]] };
+
+        /* Pick the tetrahedron containing the sample: walk from the
+         * lattice origin to the opposite corner along the axes sorted by
+         * decreasing fraction. */
+        int order[3] = { 0, 1, 2 };
+        if (f[order[0]] < f[order[1]])
+            order[0] = 1, order[1] = 0;
+        if (f[order[1]] < f[order[2]]) {
+            int t = order[1];
+            order[1] = order[2], order[2] = t;
+            if (f[order[0]] < f[order[1]])
+                t = order[0], order[0] = order[1], order[1] = t;
+        }
+
+        size_t corner1 = strides[order[0]],
+               corner2 = corner1 + strides[order[1]],
+               corner3 = corner2 + strides[order[2]];
+        float w[4] = { 1.0f - f[order[0]], f[order[0]] - f[order[1]],
+            f[order[1]] - f[order[2]], f[order[2]] };
+        uint32_t taps[4]
+            = { base[0], base[corner1], base[corner2], base[corner3] };
+
+        for (int c = 0; c < 3; c++) {
+            float v = 0.0f;
+            for (int t = 0; t < 4; t++)
+                v += ((taps[t] >> (10 * c)) & 1023) * w[t];
+            v = v * (255.0f / 1023.0f) + 0.5f;
+            p[c] = v > 255.0f ? 255 : (uint8_t)v;
+        }
+    }
+}
+
+/* Compiles a filter string into a filter chain.
+ * Every character selects a filter stage. Stages taking parameters accept
+ * them as a parenthesized, comma-separated list right after the character,
+ * e.g. `gw(2.5)i'. Unknown characters are ignored.
+ * Cross-channel colour filters are turned into colour matrices, and runs of
+ * them are multiplied into a single `m' stage so that they cost the same as
+ * one.
+ * Returns -1 on failure, 0 on success
+ * @str: Filter string, may be NULL
+ * @chain: Filter chain to be filled in
+ */
+static int parse_filters(const char *str, struct filter_chain *chain)
+{
+    chain->len = 0;
+    if (!str)
+        return 0;
+
+    while (*str) {
+        if (chain->len == FILTER_MAX_STAGES) {
+            errf("too many filter stages (max. %d)", FILTER_MAX_STAGES);
+            return -1;
+        }
+
+        struct filter *f = &chain->stages[chain->len];
+        f->op = *str++;
+        f->num_args = 0;
+        f->path = NULL;
+        f->path_len = 0;
+        f->lut = NULL;
+        f->warp = NULL;
+        f->history = NULL;
+
+        if (f->op == 'u') {
+            const char *end = *str == '(' ? strchr(str, ')') : NULL;
+            if (!end || end == str + 1) {
+                errf("filter `u' takes the path to a .cube file");
+                return -1;
+            }
+            f->path = str + 1;
+            f->path_len = (int)(end - str - 1);
+            str = end + 1;
+        } else if (*str == '(') {
+            do {
+                char *endptr;
+                if (f->num_args == FILTER_MAX_ARGS) {
+                    errf("too many arguments for filter `%c'", f->op);
+                    return -1;
+                }
+                f->args[f->num_args++] = strtod(++str, &endptr);
+                if (endptr == str) {
+                    errf("invalid argument for filter `%c'", f->op);
+                    return -1;
+                }
+                str = endptr;
+            } while (*str == ',');
+
+            if (*str++ != ')') {
+                errf("missing `)' after arguments for filter `%c'", f->op);
+                return -1;
+            }
+        }
+
+        int expected_args = -1;
+        switch (f->op) {
+        case 'g':
+        case 'i':
+        case 'l':
+        case 'd':
+        case 's':
+        case 'y':
+        case 'Y':
+            expected_args = 0;
+            break;
+        case 'S':
+        case 'h':
+            expected_args = 1;
+            break;
+        case 'x':
+            expected_args = 3;
+            for (int i = 0; i < f->num_args; i++) {
+                if (f->args[i] != 0.0 && f->args[i] != 1.0
+                    && f->args[i] != 2.0) {
+                    errf("filter `x' takes channel indices (0-2)");
+                    return -1;
+                }
+            }
+            break;
+        case 'm':
+            expected_args = 12;
+            break;
+        case 'u':
+            break;
+        case 'w':
+            if (f->num_args != 1 && f->num_args != 6 && f->num_args != 9) {
+                errf("filter `w' takes 1, 6 or 9 arguments");
+                return -1;
+            }
+            break;
+        case 'k':
+            if (f->num_args < 1 || f->num_args > 2) {
+                errf("filter `k' takes 1 or 2 arguments");
+                return -1;
+            }
+            break;
+        case 'a':
+        case 'M':
+            if (f->num_args != 1 || f->args[0] != floor(f->args[0])
+                || f->args[0] < (f->op == 'a' ? 2 : 0)
+                || f->args[0] > HISTORY_MAX_FRAMES) {
+                errf("filter `%c' takes a number of frames (%d-%d)", f->op,
+                    f->op == 'a' ? 2 : 0, HISTORY_MAX_FRAMES);
+                return -1;
+            }
+            break;
+        case 'e':
+            if (f->num_args != 1 || !(f->args[0] > 0.0 && f->args[0] <= 1.0)) {
+                errf("filter `e' takes a weight in (0, 1]");
+                return -1;
+            }
+            break;
+        case 'f':
+            if (f->num_args) {
+                errf("filter `f' takes no arguments");
+                return -1;
+            }
+            break;
+        default:
+            continue; /* ignore unknown filters */
+        }
+
+        if (expected_args < 0) {
+            chain->len++;
+            continue;
+        }
+        if (f->num_args != expected_args) {
+            errf("filter `%c' takes %d arguments", f->op, expected_args);
+            return -1;
+        }
+
+        /* Turn it into a colour matrix and fold it into the previous stage
+         * if that is a colour matrix as well. */
+        double m[12];
+        color_matrix_for(f, m);
+        struct filter *prev = chain->len ? f - 1 : NULL;
+        if (prev && prev->op == 'm') {
+            compose_color_matrices(prev->args, m);
+        } else {
+            f->op = 'm';
+            f->num_args = 12;
+            memcpy(f->args, m, sizeof(m));
+            chain->len++;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns whether the supplied filter operates on single pixels, i.e. it
+ * does not need any pixel other than the one being filtered.
+ * @f: Filter stage
+ */
+static int is_point_filter(const struct filter *f)
+{
+    return f->op == 'm' || f->op == 'u';
+}
+
+/* Returns whether a filter chain is made of point filters only.
+ * @chain: Filter chain
+ */
+static int is_point_chain(const struct filter_chain *chain)
+{
+    for (size_t i = 0; i < chain->len; i++) {
+        if (!is_point_filter(&chain->stages[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/* Applies a run of point filters to a buffer of packed RGB triplets.
+ * @buf: Pixel data
+ * @num_pixels: Number of pixels in the buffer
+ * @stages: First filter stage to be applied
+ * @num_stages: Number of filter stages
+ */
+static void apply_point_filters(uint8_t *buf, size_t num_pixels,
+    const struct filter *stages, size_t num_stages)
+{
+    for (size_t i = 0; i < num_stages; i++) {
+        switch (stages[i].op) {
+        case 'm':
+            apply_color_matrix(buf, num_pixels, stages[i].args);
+            break;
+        case 'u':
+            apply_lut3d(buf, num_pixels, stages[i].lut);
+            break;
+        }
+    }
+}
+
+/* Calculates the range of rows owned by a worker. Rows are handed out in
+ * whole tiles so that no tile is split between two workers. The renderer
+ * takes the last slice, if it takes any.
+ * @rank: Worker rank
+ * @num_rows: Number of rows in the image
+ * @row_start: First row owned by the worker
+ * @row_end: One past the last row owned by the worker
+ */
+static void worker_rows(int rank, int num_rows, int *row_start, int *row_end)
+{
+    long num_tiles = (num_rows + TILE_SIZE - 1) / TILE_SIZE;
+    *row_start
+        = min((int)(num_tiles * rank / g_num_slices) * TILE_SIZE, num_rows);
+    *row_end = min(
+        (int)(num_tiles * (rank + 1) / g_num_slices) * TILE_SIZE, num_rows);
+}
+
+/* Returns the rank of the worker owning the supplied row.
+ * @y: Row index
+ * @num_rows: Number of rows in the image
+ */
+static int row_owner(int y, int num_rows)
+{
+    long num_tiles = (num_rows + TILE_SIZE - 1) / TILE_SIZE;
+    long tile = y / TILE_SIZE;
+    int rank = (int)(tile * g_num_slices / num_tiles);
+
+    while (rank > 0 && num_tiles * rank / g_num_slices > tile)
+        rank--;
+    while (num_tiles * (rank + 1) / g_num_slices <= tile)
+        rank++;
+    return rank;
+}
+
+/* Returns the position of a tile of a strip laid out in Z-order. Tiles
+ * are numbered along a Morton curve, skipping the ones that fall outside of
+ * the strip so that it's stored without gaps.
+ * @tx: Tile column
+ * @ty: Tile row, from the top of the strip
+ * @tiles_y: Number of tile rows in the strip
+ */
+static size_t morton_rank(int tx, int ty, int tiles_y)
+{
+    int size = 1;
+    while (size < MORTON_TILES_X || size < tiles_y)
+        size <<= 1;
+
+    /* Walk down the quadtree, counting the tiles of the quadrants that come
+     * before ours. */
+    size_t rank = 0;
+    int x0 = 0, y0 = 0;
+    for (size >>= 1; size; size >>= 1) {
+        int q = (tx - x0 >= size) | (ty - y0 >= size) << 1;
+        for (int i = 0; i < q; i++) {
+            int cols = min(size, MORTON_TILES_X - x0 - (i & 1) * size);
+            int rows = min(size, tiles_y - y0 - (i >> 1) * size);
+            if (cols > 0 && rows > 0)
+                rank += (size_t)cols * rows;
+        }
+        x0 += (q & 1) * size;
+        y0 += (q >> 1) * size;
+    }
+    return rank;
+}
+
+/* Returns the offset of a pixel in a strip laid out in Z-order.
+ * @tile: Position of the tile holding the pixel, as per morton_rank()
+ * @x: Column
+ * @y: Row, from the top of the strip
+ */
+static size_t morton_offset(size_t tile, int x, int y)
+{
+    return tile * MORTON_TILE_BYTES
+        + ((size_t)(y % MORTON_TILE) * MORTON_TILE + x % MORTON_TILE)
+        * BITMAP_BPP;
+}
+
+/* Works out the positions of the tiles of a strip laid out in Z-order.
+ * @index: Output positions, row by row
+ * @tiles_y: Number of tile rows in the strip
+ */
+static void morton_index(uint32_t *index, int tiles_y)
+{
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < MORTON_TILES_X; tx++) {
+            index[ty * MORTON_TILES_X + tx]
+                = (uint32_t)morton_rank(tx, ty, tiles_y);
+        }
+    }
+}
+
+/* Copies a row-major strip into Z-ordered tiles.
+ * @dest: Output tiles
+ * @src: Rows of the strip
+ * @num_rows: Number of rows in the strip
+ * @index: Positions of the tiles, row by row, as per morton_rank()
+ */
+static void to_morton(uint8_t *dest, const uint8_t *src, int num_rows,
+    const uint32_t *index)
+{
+    for (int y = 0; y < num_rows; y++) {
+        for (int x = 0; x < BITMAP_WIDTH; x += MORTON_TILE) {
+            size_t tile = index[y / MORTON_TILE * MORTON_TILES_X
+                + x / MORTON_TILE];
+            memcpy(dest + morton_offset(tile, x, y),
+                src + (size_t)y * BITMAP_STRIDE + (size_t)x * BITMAP_BPP,
+                (size_t)min(MORTON_TILE, BITMAP_WIDTH - x) * BITMAP_BPP);
+        }
+    }
+}
+
+/* Remote tile held in the warp cache. */
+struct warp_tile {
+    int id; /* tile row times TILES_X plus tile column, -1 if unused */
+    int prev, next; /* neighbours from most to least recently used */
+    int chain; /* next tile in the same hash bucket */
+    unsigned long batch; /* last batch of output rows that needed it */
+    uint8_t data[TILE_BYTES];
+};
+
+/* Output pixels of a row computed together, from column @x0 to @x1. */
+struct warp_span {
+    int y, x0, x1;
+};
+
+/* State of a warp stage on a single worker, kept from one pass to the next.
+ * Every worker exposes a copy of its strip through a RMA window. Output rows
+ * are computed in batches of up to a tile row, fetching all the source
+ * tiles a batch needs from other workers at once into a small LRU cache. */
+struct warp_state {
+    double m[9]; /* maps output coordinates to source coordinates */
+    double k1, k2; /* radial distortion coefficients */
+    int is_radial;
+
+    int row_start, row_end, num_rows;
+    uint8_t *local; /* copy of our strip read by the current pass */
+    size_t local_len;
+    uint32_t *index; /* tile positions if laid out in Z-order, or NULL */
+    MPI_Win win;
+    MPI_Datatype origin_types[2], target_types[2];
+
+    struct warp_tile *cache;
+    int buckets[WARP_CACHE_BUCKETS];
+    int lru_head, lru_tail;
+    unsigned long batch;
+    int num_pending; /* tiles requested since the window was last flushed */
+
+    /* Source coordinates and bilinear weights of the rows of a batch, a row
+     * for every output row modulo TILE_SIZE. */
+    int *ix, *iy;
+    uint16_t *fx, *fy;
+    struct warp_span spans[TILE_SIZE];
+};
+
+/* Builds the output-to-source mapping of a warp stage.
+ * `w(deg)' rotates the image clockwise about its centre, `w(a..f)' is an
+ * affine transformation and `w(h0..h8)' a homography, both mapping output
+ * coordinates to source coordinates. `k(k1[,k2])' undoes radial lens
+ * distortion about the image centre.
+ * @state: Warp state
+ * @f: Filter stage
+ */
+static void warp_set_mapping(struct warp_state *state, const struct filter *f)
+{
+    double cx = BITMAP_WIDTH / 2.0, cy = state->num_rows / 2.0;
+
+    memset(state->m, 0, sizeof(state->m));
+    state->m[8] = 1.0;
+    state->is_radial = f->op == 'k';
+    state->k1 = state->is_radial ? f->args[0] : 0.0;
+    state->k2 = state->is_radial && f->num_args > 1 ? f->args[1] : 0.0;
+
+    if (state->is_radial)
+        return;
+
+    if (f->num_args == 1) {
+        double theta = f->args[0] * 3.14159265358979323846 / 180.0;
+        double c = cos(theta), s = sin(theta);
+        state->m[0] = c;
+        state->m[1] = s;
+        state->m[2] = cx - c * cx - s * cy;
+        state->m[3] = -s;
+        state->m[4] = c;
+        state->m[5] = cy + s * cx - c * cy;
+    } else {
+        memcpy(state->m, f->args, f->num_args * sizeof(double));
+    }
+}
+
+/* Empties the warp cache, whose tiles go stale as soon as their owners
+ * start another pass.
+ * @state: Warp state
+ */
+static void warp_reset_cache(struct warp_state *state)
+{
+    for (int i = 0; i < WARP_CACHE_TILES; i++) {
+        state->cache[i].id = -1;
+        state->cache[i].prev = i - 1;
+        state->cache[i].next = i + 1 < WARP_CACHE_TILES ? i + 1 : -1;
+        state->cache[i].batch = 0;
+    }
+    for (int i = 0; i < WARP_CACHE_BUCKETS; i++)
+        state->buckets[i] = -1;
+    state->lru_head = 0;
+    state->lru_tail = WARP_CACHE_TILES - 1;
+    state->batch = 0;
+}
+
+/* Returns the slot holding a remote tile in the warp cache, or -1 if it
+ * isn't cached.
+ * @state: Warp state
+ * @id: Tile row times TILES_X plus tile column
+ */
+static int warp_lookup(const struct warp_state *state, int id)
+{
+    int i = state->buckets[id & (WARP_CACHE_BUCKETS - 1)];
+    while (i >= 0 && state->cache[i].id != id)
+        i = state->cache[i].chain;
+    return i;
+}
+
+/* Moves a tile to the front of the LRU list of the warp cache.
+ * @state: Warp state
+ * @i: Slot holding the tile
+ */
+static void warp_touch(struct warp_state *state, int i)
+{
+    struct warp_tile *tile = &state->cache[i];
+    if (state->lru_head == i)
+        return;
+
+    state->cache[tile->prev].next = tile->next;
+    if (tile->next >= 0)
+        state->cache[tile->next].prev = tile->prev;
+    else
+        state->lru_tail = tile->prev;
+
+    tile->prev = -1;
+    tile->next = state->lru_head;
+    state->cache[state->lru_head].prev = i;
+    state->lru_head = i;
+}
+
+/* Makes sure a remote tile is in the warp cache for the current batch,
+ * requesting it from its owner if it isn't. Requests complete once the
+ * window is flushed.
+ * Returns 0 if the cache is full of tiles needed by the batch, 1 otherwise
+ * @state: Warp state
+ * @tx: Tile column
+ * @ty: Tile row
+ */
+static int warp_request_tile(struct warp_state *state, int tx, int ty)
+{
+    int id = ty * TILES_X + tx, i = warp_lookup(state, id);
+
+    if (i < 0) {
+        /* Take the least recently used slot over, unless the batch needs
+         * every tile in the cache. */
+        i = state->lru_tail;
+        struct warp_tile *tile = &state->cache[i];
+        if (tile->batch == state->batch)
+            return 0;
+
+        if (tile->id >= 0) {
+            int *p = &state->buckets[tile->id & (WARP_CACHE_BUCKETS - 1)];
+            while (*p != i)
+                p = &state->cache[*p].chain;
+            *p = tile->chain;
+        }
+        int *bucket = &state->buckets[id & (WARP_CACHE_BUCKETS - 1)];
+        tile->id = id;
+        tile->chain = *bucket;
+        *bucket = i;
+
+        int y = ty * TILE_SIZE, x = tx * TILE_SIZE;
+        int rows = min(TILE_SIZE, state->num_rows - y);
+        int edge = x + TILE_SIZE > BITMAP_WIDTH;
+        int owner = row_owner(y, state->num_rows), owner_start, owner_end;
+        worker_rows(owner, state->num_rows, &owner_start, &owner_end);
+
+        MPI_Aint disp;
+        if (state->index) {
+            int ly = y - owner_start;
+            int tiles_y
+                = (owner_end - owner_start + MORTON_TILE - 1) / MORTON_TILE;
+            disp = (MPI_Aint)morton_offset(
+                morton_rank(x / MORTON_TILE, ly / MORTON_TILE, tiles_y), x,
+                ly);
+        } else {
+            disp = (MPI_Aint)(y - owner_start) * BITMAP_STRIDE
+                + (MPI_Aint)x * BITMAP_BPP;
+        }
+        MPI_Check(MPI_Get(tile->data, rows, state->origin_types[edge], owner,
+            disp, rows, state->target_types[edge], state->win));
+        state->num_pending++;
+    }
+
+    state->cache[i].batch = state->batch;
+    warp_touch(state, i);
+    return 1;
+}
+
+/* Works out where the pixels of an output row come from.
+ * @state: Warp state
+ * @y: Output row index
+ */
+static void warp_coords(struct warp_state *state, int y)
+{
+    const double *m = state->m;
+    double cx = BITMAP_WIDTH / 2.0, cy = state->num_rows / 2.0;
+    double norm = 1.0 / (cx * cx + cy * cy);
+    size_t row = (size_t)(y % TILE_SIZE) * BITMAP_WIDTH;
+
+    for (int x = 0; x < BITMAP_WIDTH; x++) {
+        double sx, sy;
+        if (state->is_radial) {
+            double dx = x - cx, dy = y - cy, r2 = (dx * dx + dy * dy) * norm;
+            double scale = 1.0 + r2 * (state->k1 + r2 * state->k2);
+            sx = cx + dx * scale;
+            sy = cy + dy * scale;
+        } else {
+            double w = m[6] * x + m[7] * y + m[8];
+            sx = (m[0] * x + m[1] * y + m[2]) / w;
+            sy = (m[3] * x + m[4] * y + m[5]) / w;
+        }
+
+        /* Keep coordinates sane before converting them to integers. */
+        if (!(sx > -2.0 && sx < BITMAP_WIDTH + 1.0 && sy > -2.0
+                && sy < state->num_rows + 1.0)) {
+            sx = sy = -2.0;
+        }
+
+        double x0 = floor(sx), y0 = floor(sy);
+        state->ix[row + x] = (int)x0;
+        state->iy[row + x] = (int)y0;
+        state->fx[row + x] = (uint16_t)((sx - x0) * 256.0);
+        state->fy[row + x] = (uint16_t)((sy - y0) * 256.0);
+    }
+}
+
+/* Requests the remote tiles holding the four taps of an output pixel.
+ * Returns 0 if they don't fit in the cache along with the rest of the
+ * batch, 1 otherwise
+ * @state: Warp state
+ * @ix: Column of the top-left tap
+ * @iy: Row of the top-left tap
+ */
+static int warp_request_taps(struct warp_state *state, int ix, int iy)
+{
+    for (int t = 0; t < 4; t++) {
+        int x = ix + (t & 1), y = iy + (t >> 1);
+        if (x < 0 || y < 0 || x >= BITMAP_WIDTH || y >= state->num_rows
+            || (y >= state->row_start && y < state->row_end))
+            continue;
+        if (!warp_request_tile(state, x / TILE_SIZE, y / TILE_SIZE))
+            return 0;
+    }
+    return 1;
+}
+
+/* Gathers the next batch of output pixels and requests the remote tiles
+ * they need. A batch ends after a tile row's worth of rows, or as soon as
+ * the cache is full of tiles it needs, even in the middle of a row. The
+ * coordinates of every row it may reach must have been worked out.
+ * Returns the number of spans in the batch
+ * @state: Warp state
+ * @y: Row the batch starts at, updated to where the next one starts
+ * @x: Column the batch starts at, likewise
+ */
+static int warp_batch(struct warp_state *state, int *y, int *x)
+{
+    int num_spans = 0;
+
+    state->batch++;
+    while (*y < state->row_end && num_spans < TILE_SIZE) {
+        size_t row = (size_t)(*y % TILE_SIZE) * BITMAP_WIDTH;
+
+        int x1 = *x;
+        while (x1 < BITMAP_WIDTH
+            && warp_request_taps(state, state->ix[row + x1],
+                state->iy[row + x1]))
+            x1++;
+
+        if (x1 > *x) {
+            struct warp_span *span = &state->spans[num_spans++];
+            span->y = *y;
+            span->x0 = *x;
+            span->x1 = x1;
+        }
+        if (x1 < BITMAP_WIDTH) {
+            *x = x1;
+            break;
+        }
+        (*y)++;
+        *x = 0;
+    }
+
+    return num_spans;
+}
+
+/* Returns a pointer to the RGB triplet of a source pixel, or black if the
+ * coordinates fall outside of the image. Remote pixels must have been
+ * requested by the current batch.
+ * @state: Warp state
+ * @x: Column
+ * @y: Row
+ * @last: Slot of the remote tile looked up last, or -1
+ */
+static const uint8_t *warp_pixel(
+    const struct warp_state *state, int x, int y, int *last)
+{
+    static const uint8_t black[BITMAP_BPP];
+
+    if (x < 0 || y < 0 || x >= BITMAP_WIDTH || y >= state->num_rows)
+        return black;
+    if (y >= state->row_start && y < state->row_end) {
+        int ly = y - state->row_start;
+        if (!state->index) {
+            return state->local + (size_t)ly * BITMAP_STRIDE
+                + (size_t)x * BITMAP_BPP;
+        }
+        size_t tile = state->index[ly / MORTON_TILE * MORTON_TILES_X
+            + x / MORTON_TILE];
+        return state->local + morton_offset(tile, x, ly);
+    }
+
+    int id = y / TILE_SIZE * TILES_X + x / TILE_SIZE;
+    if (*last < 0 || state->cache[*last].id != id)
+        *last = warp_lookup(state, id);
+    return state->cache[*last].data
+        + ((y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE) * BITMAP_BPP;
+}
+
+/* Blends four taps per pixel using 8-bit fixed point bilinear weights.
+ * Taps are packed as 0x00BBGGRR.
+ * @dest: Output RGB triplets
+ * @taps: Top-left, top-right, bottom-left and bottom-right taps
+ * @fx: Horizontal weights in [0, 256]
+ * @fy: Vertical weights in [0, 256]
+ * @n: Number of pixels
+ */
+static void bilerp_span(uint8_t *dest, uint32_t *const taps[4],
+    const uint16_t *fx, const uint16_t *fy, size_t n)
+{
+    size_t i = 0;
+
+#ifdef HAVE_SSE2
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(256);
+    for (; i + 2 <= n; i += 2) {
+        __m128i p00 = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(taps[0] + i)), zero);
+        __m128i p01 = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(taps[1] + i)), zero);
+        __m128i p10 = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(taps[2] + i)), zero);
+        __m128i p11 = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(taps[3] + i)), zero);
+        __m128i wx = _mm_set_epi16(fx[i + 1], fx[i + 1], fx[i + 1],
+            fx[i + 1], fx[i], fx[i], fx[i], fx[i]);
+        __m128i wy = _mm_set_epi16(fy[i + 1], fy[i + 1], fy[i + 1],
+            fy[i + 1], fy[i], fy[i], fy[i], fy[i]);
+        __m128i ix = _mm_sub_epi16(one, wx), iy = _mm_sub_epi16(one, wy);
+
+        __m128i top = _mm_srli_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(p00, ix), _mm_mullo_epi16(p01, wx)),
+            8);
+        __m128i bottom = _mm_srli_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(p10, ix), _mm_mullo_epi16(p11, wx)),
+            8);
+        __m128i res = _mm_srli_epi16(
+            _mm_add_epi16(
+                _mm_mullo_epi16(top, iy), _mm_mullo_epi16(bottom, wy)),
+            8);
+
+        uint32_t out[2];
+        _mm_storel_epi64((__m128i *)out, _mm_packus_epi16(res, res));
+        for (int j = 0; j < 2; j++) {
+            dest[(i + j) * BITMAP_BPP + 0] = (uint8_t)out[j];
+            dest[(i + j) * BITMAP_BPP + 1] = (uint8_t)(out[j] >> 8);
+            dest[(i + j) * BITMAP_BPP + 2] = (uint8_t)(out[j] >> 16);
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        for (int c = 0; c < BITMAP_BPP; c++) {
+            unsigned p00 = (taps[0][i] >> (8 * c)) & 0xff,
+                     p01 = (taps[1][i] >> (8 * c)) & 0xff,
+                     p10 = (taps[2][i] >> (8 * c)) & 0xff,
+                     p11 = (taps[3][i] >> (8 * c)) & 0xff;
+            unsigned top = (p00 * (256 - fx[i]) + p01 * fx[i]) >> 8;
+            unsigned bottom = (p10 * (256 - fx[i]) + p11 * fx[i]) >> 8;
+            dest[i * BITMAP_BPP + c]
+                = (uint8_t)((top * (256 - fy[i]) + bottom * fy[i]) >> 8);
+        }
+    }
+}
+
+/* Computes a span of output pixels whose source tiles have been fetched.
+ * @state: Warp state
+ * @dest: Output strip
+ * @span: Span of pixels
+ */
+static void warp_span(const struct warp_state *state, uint8_t *dest,
+    const struct warp_span *span)
+{
+    size_t row = (size_t)(span->y % TILE_SIZE) * BITMAP_WIDTH;
+    uint8_t *out = dest + (size_t)(span->y - state->row_start) * BITMAP_STRIDE;
+    uint32_t taps[4][TILE_SIZE];
+    uint32_t *const tap_rows[4] = { taps[0], taps[1], taps[2], taps[3] };
+    int last = -1;
+
+    /* A tile's width at a time, so that the taps fit on the stack. */
+    for (int x = span->x0; x < span->x1;) {
+        int n = min(TILE_SIZE - x % TILE_SIZE, span->x1 - x);
+        for (int i = 0; i < n; i++) {
+            int ix = state->ix[row + x + i], iy = state->iy[row + x + i];
+            for (int t = 0; t < 4; t++) {
+                const uint8_t *p = warp_pixel(
+                    state, ix + (t & 1), iy + (t >> 1), &last);
+                taps[t][i] = p[0] | (uint32_t)p[1] << 8
+                    | (uint32_t)p[2] << 16;
+            }
+        }
+
+        bilerp_span(out + (size_t)x * BITMAP_BPP, tap_rows,
+            state->fx + row + x, state->fy + row + x, n);
+        x += n;
+    }
+}
+
+/* Sets up a warp stage for the rows owned by this worker. This is a
+ * collective operation: every worker must call it for the same stage.
+ * Returns the state of the stage
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @num_rows: Number of rows in the image
+ */
+static struct warp_state *init_warp(int row_start, int row_end, int num_rows)
+{
+    struct warp_state *state = malloc(sizeof(struct warp_state));
+    size_t batch_len = (size_t)TILE_SIZE * BITMAP_WIDTH;
+
+    state->row_start = row_start;
+    state->row_end = row_end;
+    state->num_rows = num_rows;
+    state->local_len = (size_t)(row_end - row_start) * BITMAP_STRIDE;
+    state->index = NULL;
+    if (g_opts.layout == LAYOUT_MORTON) {
+        /* Vertical neighbours are a whole stride apart in rows, but mostly
+         * in the same tile, and so in the same cache lines and pages, in
+         * Z-order. */
+        int tiles_y = (row_end - row_start + MORTON_TILE - 1) / MORTON_TILE;
+        state->index = malloc(
+            (size_t)MORTON_TILES_X * tiles_y * sizeof(uint32_t));
+        morton_index(state->index, tiles_y);
+        state->local_len
+            = (size_t)MORTON_TILES_X * tiles_y * MORTON_TILE_BYTES;
+        g_num_allocs++;
+    }
+    state->local = alloc_buffer(state->local_len);
+    state->cache = alloc_buffer(WARP_CACHE_TILES * sizeof(struct warp_tile));
+    state->num_pending = 0;
+    state->ix = alloc_buffer(batch_len * sizeof(int));
+    state->iy = alloc_buffer(batch_len * sizeof(int));
+    state->fx = alloc_buffer(batch_len * sizeof(uint16_t));
+    state->fy = alloc_buffer(batch_len * sizeof(uint16_t));
+    g_num_allocs++;
+
+    /* Row layouts of full and right-most tiles, both in the cache and in the
+     * strips exposed by their owners. */
+    for (int edge = 0; edge < 2; edge++) {
+        int cols = edge && BITMAP_WIDTH % TILE_SIZE ? BITMAP_WIDTH % TILE_SIZE
+                                                    : TILE_SIZE;
+        MPI_Datatype row_type;
+        MPI_Check(MPI_Type_contiguous(cols * BITMAP_BPP, MPI_BYTE, &row_type));
+        MPI_Check(MPI_Type_create_resized(row_type, 0,
+            TILE_SIZE * BITMAP_BPP, &state->origin_types[edge]));
+        MPI_Check(MPI_Type_create_resized(row_type, 0,
+            state->index ? MORTON_TILE * BITMAP_BPP : BITMAP_STRIDE,
+            &state->target_types[edge]));
+        MPI_Check(MPI_Type_commit(&state->origin_types[edge]));
+        MPI_Check(MPI_Type_commit(&state->target_types[edge]));
+        MPI_Check(MPI_Type_free(&row_type));
+    }
+
+    /* The window lives as long as the stage, locked all along. A single
+     * worker owns every pixel and needs no window at all. */
+    state->win = MPI_WIN_NULL;
+    if (g_size > 1) {
+        MPI_Check(MPI_Win_create(state->local, state->local_len, 1,
+            MPI_INFO_NULL, MPI_COMM_WORLD, &state->win));
+        MPI_Check(MPI_Win_lock_all(MPI_MODE_NOCHECK, state->win));
+    }
+
+    return state;
+}
+
+/* Tears a warp stage down. This is a collective operation.
+ * @state: Warp state
+ */
+static void free_warp(struct warp_state *state)
+{
+    if (state->win != MPI_WIN_NULL) {
+        MPI_Check(MPI_Win_unlock_all(state->win));
+        MPI_Check(MPI_Win_free(&state->win));
+    }
+    for (int edge = 0; edge < 2; edge++) {
+        MPI_Type_free(&state->origin_types[edge]);
+        MPI_Type_free(&state->target_types[edge]);
+    }
+    free_buffer(state->ix);
+    free_buffer(state->iy);
+    free_buffer(state->fx);
+    free_buffer(state->fy);
+    free_buffer(state->cache);
+    free_buffer(state->local);
+    free(state->index);
+    free(state);
+}
+
+struct thread_pool;
+static struct thread_pool *g_pool;
+static void pool_run(struct thread_pool *pool, int num_tasks,
+    void (*fn)(void *arg, int task), void *arg);
+
+/* Rows of a warp batch worked out in parallel, one row or span per task. */
+struct warp_job {
+    struct warp_state *state;
+    uint8_t *buf;
+    int y; /* first row whose coordinates are worked out */
+};
+
+/* Works out the source coordinates of an output row of the next batches.
+ * @arg: Warp job
+ * @i: Row index, counted from the job's first row
+ */
+static void warp_coords_task(void *arg, int i)
+{
+    const struct warp_job *job = arg;
+    warp_coords(job->state, job->y + i);
+}
+
+/* Interpolates a span of the current batch, whose tiles have arrived.
+ * @arg: Warp job
+ * @i: Span index
+ */
+static void warp_span_task(void *arg, int i)
+{
+    const struct warp_job *job = arg;
+    warp_span(job->state, job->buf, &job->state->spans[i]);
+}
+
+/* Runs a warp stage over the rows owned by this worker, in place. This is a
+ * collective operation: every worker must call it for the same stage.
+ * @buf: Rows owned by this worker
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @num_rows: Number of rows in the image
+ * @f: Warp filter stage, set up on its first pass
+ */
+static void warp_strip(
+    uint8_t *buf, int row_start, int row_end, int num_rows, struct filter *f)
+{
+    if (!f->warp)
+        f->warp = init_warp(row_start, row_end, num_rows);
+
+    struct warp_state *state = f->warp;
+    warp_set_mapping(state, f);
+    warp_reset_cache(state);
+
+    /* Everyone reads from a copy of the strip while it's overwritten. Wait
+     * for everyone else to have theirs ready. */
+    if (state->index)
+        to_morton(state->local, buf, row_end - row_start, state->index);
+    else
+        memcpy(state->local, buf, state->local_len);
+    if (g_size > 1) {
+        MPI_Check(MPI_Win_sync(state->win));
+        MPI_Check(MPI_Barrier(MPI_COMM_WORLD));
+    }
+
+    /* Only this thread requests tiles and flushes the window; the pool
+     * works out coordinates ahead of every batch and interpolates its
+     * spans once the tiles are in. */
+    struct warp_job job = { state, buf, row_start };
+    for (int y = row_start, x = 0; y < row_end;) {
+        /* A batch reaches TILE_SIZE rows at most, each with its own row
+         * of coordinates. */
+        int coords_end = min(y + TILE_SIZE, row_end);
+        pool_run(g_pool, coords_end - job.y, warp_coords_task, &job);
+        job.y = coords_end;
+
+        int num_spans = warp_batch(state, &y, &x);
+        if (state->num_pending) {
+            MPI_Check(MPI_Win_flush_all(state->win));
+            state->num_pending = 0;
+        }
+        pool_run(g_pool, num_spans, warp_span_task, &job);
+    }
+
+    /* Nobody may take another copy before everyone is done reading. */
+    if (g_size > 1)
+        MPI_Check(MPI_Barrier(MPI_COMM_WORLD));
+}
+
+/* Frames a temporal filter stage has seen, kept by every worker for its own
+ * rows only. */
+struct history {
+    size_t len; /* bytes per frame, 0 until the first frame */
+    int depth; /* frames in the ring */
+    int count; /* frames seen, up to depth */
+    int next; /* ring slot the next frame goes to */
+    uint8_t *frames;
+    uint16_t *sums; /* `a': sums of the ring; `e': smoothed values in 8.8 */
+    uint8_t *quot; /* `a': rounded quotients of sums by count */
+    int quot_count;
+};
+
+/* Checks whether a filter stage depends on previous frames.
+ * Returns 1 if it does, 0 otherwise
+ * @f: Filter stage
+ */
+static int is_temporal_filter(const struct filter *f)
+{
+    return f->op == 'a' || f->op == 'e' || f->op == 'f' || f->op == 'M';
+}
+
+/* Forgets every frame a temporal filter stage has seen.
+ * @history: History of the stage
+ */
+static void reset_history(struct history *history)
+{
+    history->count = 0;
+    history->next = 0;
+    history->quot_count = 0;
+    if (history->sums)
+        memset(history->sums, 0, history->len * sizeof(uint16_t));
+}
+
+/* Running average of the last n frames: adds part of a frame to the ring
+ * and replaces it with the average. The quotient table must be ready for
+ * the count the frame brings the ring to.
+ * @history: History of the stage
+ * @buf: Frame, replaced with the output
+ * @first: Offset of the first byte to filter
+ * @end: One past the offset of the last byte to filter
+ */
+static void temporal_average(
+    const struct history *history, uint8_t *buf, size_t first, size_t end)
+{
+    size_t i = first;
+    uint8_t *slot = history->frames + history->next * history->len;
+    uint16_t *sums = history->sums;
+    int full = history->count == history->depth;
+
+#ifdef HAVE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= end; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i out = _mm_loadu_si128((const __m128i *)(slot + i));
+        if (!full)
+            out = zero;
+        __m128i lo = _mm_loadu_si128((const __m128i *)(sums + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(sums + i + 8));
+        lo = _mm_sub_epi16(_mm_add_epi16(lo, _mm_unpacklo_epi8(in, zero)),
+            _mm_unpacklo_epi8(out, zero));
+        hi = _mm_sub_epi16(_mm_add_epi16(hi, _mm_unpackhi_epi8(in, zero)),
+            _mm_unpackhi_epi8(out, zero));
+        _mm_storeu_si128((__m128i *)(sums + i), lo);
+        _mm_storeu_si128((__m128i *)(sums + i + 8), hi);
+    }
+#endif
+    for (; i < end; i++)
+        sums[i] += buf[i] - (full ? slot[i] : 0);
+
+    memcpy(slot + first, buf + first, end - first);
+    for (i = first; i < end; i++)
+        buf[i] = history->quot[sums[i]];
+}
+
+/* Exponential smoothing: blends part of a frame into the smoothed values
+ * and replaces it with them.
+ * @history: History of the stage
+ * @buf: Frame, replaced with the output
+ * @first: Offset of the first byte to filter
+ * @end: One past the offset of the last byte to filter
+ * @alpha: Weight of the new frame, in (0, 1]
+ */
+static void temporal_smooth(const struct history *history, uint8_t *buf,
+    size_t first, size_t end, double alpha)
+{
+    uint16_t *sums = history->sums;
+    uint32_t a = (uint32_t)lround(alpha * 256.0);
+    a = a < 1 ? 1 : a;
+
+    if (!history->count) {
+        for (size_t i = first; i < end; i++)
+            sums[i] = (uint16_t)(buf[i] << 8);
+    }
+
+    for (size_t i = first; i < end; i++) {
+        sums[i] = (uint16_t)((sums[i] * (256 - a) + (buf[i] << 8) * a + 128)
+            >> 8);
+        buf[i] = (uint8_t)((sums[i] + 128) >> 8);
+    }
+}
+
+/* Frame differencing: replaces part of a frame with its absolute
+ * difference to the previous one, which is black for the first frame.
+ * @history: History of the stage
+ * @buf: Frame, replaced with the output
+ * @first: Offset of the first byte to filter
+ * @end: One past the offset of the last byte to filter
+ */
+static void temporal_difference(
+    const struct history *history, uint8_t *buf, size_t first, size_t end)
+{
+    size_t i = first;
+    uint8_t *prev = history->frames;
+    if (!history->count)
+        memcpy(prev + first, buf + first, end - first);
+
+#ifdef HAVE_SSE2
+    for (; i + 16 <= end; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i p = _mm_loadu_si128((const __m128i *)(prev + i));
+        _mm_storeu_si128((__m128i *)(prev + i), in);
+        _mm_storeu_si128((__m128i *)(buf + i),
+            _mm_or_si128(_mm_subs_epu8(in, p), _mm_subs_epu8(p, in)));
+    }
+#endif
+    for (; i < end; i++) {
+        uint8_t in = buf[i];
+        buf[i] = (uint8_t)abs(in - prev[i]);
+        prev[i] = in;
+    }
+}
+
+/* Max-hold: replaces part of a frame with the maximum of the last n frames,
+ * or of every frame so far if the ring holds a single frame only.
+ * @history: History of the stage
+ * @buf: Frame, replaced with the output
+ * @first: Offset of the first byte to filter
+ * @end: One past the offset of the last byte to filter
+ * @hold: Whether to hold the maximum of every frame
+ */
+static void temporal_max(const struct history *history, uint8_t *buf,
+    size_t first, size_t end, int hold)
+{
+    size_t len = history->len;
+    if (!hold) {
+        memcpy(history->frames + history->next * len + first, buf + first,
+            end - first);
+    } else if (!history->count) {
+        memcpy(history->frames + first, buf + first, end - first);
+    }
+
+    int count = history->count < history->depth ? history->count + 1
+                                                 : history->count;
+    for (int f = 0; f < count; f++) {
+        const uint8_t *frame = history->frames + f * len;
+        uint8_t *dest = hold ? history->frames : buf;
+        size_t i = first;
+#ifdef HAVE_SSE2
+        for (; i + 16 <= end; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(frame + i));
+            _mm_storeu_si128((__m128i *)(dest + i), _mm_max_epu8(a, b));
+        }
+#endif
+        for (; i < end; i++)
+            dest[i] = buf[i] > frame[i] ? buf[i] : frame[i];
+    }
+
+    if (hold)
+        memcpy(buf + first, history->frames + first, end - first);
+}
+
+/* Gets the history of a temporal filter stage ready for the next frame the
+ * stage sees, starting over if the frame isn't as long as the last one.
+ * @f: Filter stage
+ * @len: Length of the frame in bytes
+ */
+static void prepare_history(const struct filter *f, size_t len)
+{
+    struct history *history = f->history;
+    if (history->len != len) {
+        /* First frame, or a different strip: start over. */
+        int depth = f->op == 'a' || f->op == 'M' ? (int)f->args[0] : 1;
+        history->len = len;
+        history->depth = depth > 0 ? depth : 1;
+        free_buffer(history->frames);
+        free_buffer(history->sums);
+        free(history->quot);
+        history->frames
+            = f->op == 'e' ? NULL : alloc_buffer(history->depth * len);
+        history->sums = f->op == 'a' || f->op == 'e'
+            ? alloc_buffer(len * sizeof(uint16_t))
+            : NULL;
+        history->quot
+            = f->op == 'a' ? malloc(255 * HISTORY_MAX_FRAMES + 1) : NULL;
+        g_num_allocs += history->quot != NULL;
+        reset_history(history);
+    }
+
+    /* Averages divide through a table, as the count only changes while the
+     * ring fills up. */
+    int n = history->count < history->depth ? history->count + 1
+                                            : history->count;
+    if (f->op == 'a' && history->quot_count != n) {
+        for (int s = 0; s <= 255 * n; s++)
+            history->quot[s] = (uint8_t)((s + n / 2) / n);
+        history->quot_count = n;
+    }
+}
+
+/* Applies a temporal filter stage to part of a frame. Parts never overlap,
+ * so they may be filtered concurrently, between prepare_history() and
+ * advance_history().
+ * @buf: Frame, replaced with the output
+ * @first: Offset of the first byte to filter
+ * @end: One past the offset of the last byte to filter
+ * @f: Filter stage
+ */
+static void apply_temporal_range(
+    uint8_t *buf, size_t first, size_t end, const struct filter *f)
+{
+    const struct history *history = f->history;
+    switch (f->op) {
+    case 'a':
+        temporal_average(history, buf, first, end);
+        break;
+    case 'e':
+        temporal_smooth(history, buf, first, end, f->args[0]);
+        break;
+    case 'f':
+        temporal_difference(history, buf, first, end);
+        break;
+    case 'M':
+        temporal_max(history, buf, first, end, !f->args[0]);
+        break;
+    }
+}
+
+/* Counts a frame into the history of a temporal filter stage, once every
+ * part of it has been filtered.
+ * @f: Filter stage
+ */
+static void advance_history(const struct filter *f)
+{
+    struct history *history = f->history;
+    if (f->op == 'a' || (f->op == 'M' && f->args[0]))
+        history->next = (history->next + 1) % history->depth;
+    if (history->count < history->depth)
+        history->count++;
+}
+
+/* Divides a 16-bit product of two 8-bit values by 255, rounding. */
+#define DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+#ifdef HAVE_SSE2
+static inline __m128i div255_epu16(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+#endif
+
+/* Composites every layer over a buffer of packed RGB triplets in a single
+ * pass.
+ * @buf: Pixel data of the input file, replaced by the result
+ * @layer_bufs: Pixel data of every layer, covering the same pixels
+ * @layer_bpp: Bytes per pixel of every layer (3 or 4)
+ * @num_pixels: Number of pixels in the buffers
+ */
+static void composite_layers(uint8_t *buf, uint8_t *const *layer_bufs,
+    const int *layer_bpp, size_t num_pixels)
+{
+    size_t off = 0;
+    uint8_t opacity[MAX_LAYERS];
+    for (size_t l = 0; l < g_opts.num_layers; l++)
+        opacity[l] = (uint8_t)(g_opts.layers[l].opacity * 255.0 + 0.5);
+
+#ifdef HAVE_SSE2
+    /* Two pixels per register, widened to 16-bit RGBA lanes. */
+    const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi16(255),
+                  opaque = _mm_set1_epi32((int)0xff000000u);
+    for (; off + 4 <= num_pixels; off += 4) {
+        uint8_t *p = buf + off * BITMAP_BPP;
+        __m128i px = _mm_set_epi32(p[9] | p[10] << 8 | p[11] << 16,
+            p[6] | p[7] << 8 | p[8] << 16, p[3] | p[4] << 8 | p[5] << 16,
+            p[0] | p[1] << 8 | p[2] << 16);
+        __m128i base[2]
+            = { _mm_unpacklo_epi8(px, zero), _mm_unpackhi_epi8(px, zero) };
+
+        for (size_t l = 0; l < g_opts.num_layers; l++) {
+            const uint8_t *q = layer_bufs[l] + off * layer_bpp[l];
+            __m128i top_px;
+            if (layer_bpp[l] == 4) {
+                top_px = _mm_loadu_si128((const __m128i *)q);
+            } else {
+                top_px = _mm_or_si128(
+                    _mm_set_epi32(q[9] | q[10] << 8 | q[11] << 16,
+                        q[6] | q[7] << 8 | q[8] << 16,
+                        q[3] | q[4] << 8 | q[5] << 16,
+                        q[0] | q[1] << 8 | q[2] << 16),
+                    opaque);
+            }
+            __m128i tops[2] = { _mm_unpacklo_epi8(top_px, zero),
+                _mm_unpackhi_epi8(top_px, zero) };
+            __m128i layer_opacity = _mm_set1_epi16(opacity[l]);
+
+            for (int h = 0; h < 2; h++) {
+                __m128i b = base[h], t = tops[h], blend;
+                switch (g_opts.layers[l].mode) {
+                case BLEND_MULTIPLY:
+                    blend = div255_epu16(_mm_mullo_epi16(b, t));
+                    break;
+                case BLEND_SCREEN:
+                    blend = _mm_sub_epi16(full,
+                        div255_epu16(_mm_mullo_epi16(
+                            _mm_sub_epi16(full, b), _mm_sub_epi16(full, t))));
+                    break;
+                case BLEND_DIFFERENCE:
+                    blend = _mm_sub_epi16(
+                        _mm_max_epi16(b, t), _mm_min_epi16(b, t));
+                    break;
+                default:
+                    blend = t;
+                    break;
+                }
+
+                /* Broadcast each pixel's alpha to all of its lanes. */
+                __m128i a = _mm_shufflehi_epi16(
+                    _mm_shufflelo_epi16(t, _MM_SHUFFLE(3, 3, 3, 3)),
+                    _MM_SHUFFLE(3, 3, 3, 3));
+                a = div255_epu16(_mm_mullo_epi16(a, layer_opacity));
+                base[h] = div255_epu16(
+                    _mm_add_epi16(_mm_mullo_epi16(b, _mm_sub_epi16(full, a)),
+                        _mm_mullo_epi16(blend, a)));
+            }
+        }
+
+        uint8_t out[16];
+        _mm_storeu_si128(
+            (__m128i *)out, _mm_packus_epi16(base[0], base[1]));
+        for (int j = 0; j < 4; j++) {
+            p[j * BITMAP_BPP + 0] = out[j * 4 + 0];
+            p[j * BITMAP_BPP + 1] = out[j * 4 + 1];
+            p[j * BITMAP_BPP + 2] = out[j * 4 + 2];
+        }
+    }
+#endif
+
+    for (; off < num_pixels; off++) {
+        uint8_t *p = buf + off * BITMAP_BPP;
+        for (size_t l = 0; l < g_opts.num_layers; l++) {
+            const uint8_t *q = layer_bufs[l] + off * layer_bpp[l];
+            unsigned a = layer_bpp[l] == 4 ? q[3] : 255;
+            a = DIV255(a * opacity[l]);
+
+            for (int c = 0; c < 3; c++) {
+                unsigned b = p[c], t = q[c], blend;
+                switch (g_opts.layers[l].mode) {
+                case BLEND_MULTIPLY:
+                    blend = DIV255(b * t);
+                    break;
+                case BLEND_SCREEN:
+                    blend = 255 - DIV255((255 - b) * (255 - t));
+                    break;
+                case BLEND_DIFFERENCE:
+                    blend = b > t ? b - t : t - b;
+                    break;
+                default:
+                    blend = t;
+                    break;
+                }
+                p[c] = (uint8_t)DIV255(b * (255 - a) + blend * a);
+            }
+        }
+    }
+}
+
+/* Reads the rows owned by this worker from a layer. This is a collective
+ * operation.
+ * Returns a newly allocated buffer holding the rows
+ * @layer: Layer to be read
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @num_rows: Number of rows in the input file
+ * @bpp: Bytes per pixel of the layer
+ */
+static uint8_t *read_layer(const struct layer *layer, int row_start,
+    int row_end, int num_rows, int *bpp)
+{
+    MPI_File file;
+    MPI_Offset len;
+    logf("opening layer `%s' for reading", layer->path);
+    MPI_Check(MPI_File_open(MPI_COMM_WORLD, layer->path, MPI_MODE_RDONLY,
+        MPI_INFO_NULL, &file));
+    MPI_Check_close(&file, MPI_File_get_size(file, &len));
+
+    /* Tell RGB and RGBA layers apart by their size. */
+    MPI_Offset num_pixels = (MPI_Offset)num_rows * BITMAP_WIDTH;
+    if (len == num_pixels * 4) {
+        *bpp = 4;
+    } else if (len == num_pixels * 3) {
+        *bpp = 3;
+    } else {
+        errf("invalid layer length. Expected %lld (RGB) or %lld (RGBA) "
+             "bytes but got %lld.",
+            num_pixels * 3, num_pixels * 4, len);
+        MPI_File_close(&file);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+
+    MPI_Offset stride = (MPI_Offset)BITMAP_WIDTH * *bpp,
+               chunk_len = (MPI_Offset)(row_end - row_start) * stride;
+    uint8_t *buf = alloc_buffer(chunk_len);
+    MPI_Check(MPI_File_read_at_all(file, row_start * stride, buf,
+        (int)chunk_len, MPI_BYTE, MPI_STATUS_IGNORE));
+    MPI_Check(MPI_File_close(&file));
+    return buf;
+}
+
+/* Compares two spans of packed RGB triplets.
+ * Returns the number of pixels differing by more than @threshold in any
+ * channel
+ * @a: First span
+ * @b: Second span
+ * @n: Number of pixels
+ * @threshold: Largest channel difference not considered a change
+ * @sse: Incremented by the sum of squared channel differences
+ * @max_delta: Raised to the largest channel difference, if greater
+ */
+static size_t diff_span(const uint8_t *a, const uint8_t *b, size_t n,
+    int threshold, uint64_t *sse, int *max_delta)
+{
+    size_t i = 0, changed = 0;
+
+#ifdef HAVE_SSE2
+    /* 16 pixels (three registers) at a time. Each register yields a mask
+     * of the bytes above the threshold; a pixel has changed if any of its
+     * three bits is set. */
+    const __m128i zero = _mm_setzero_si128(),
+                  thr = _mm_set1_epi8((char)threshold);
+    __m128i vmax = zero, vsse = zero;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t mask = 0;
+        for (int k = 0; k < 3; k++) {
+            __m128i va = _mm_loadu_si128(
+                (const __m128i *)(a + i * BITMAP_BPP + 16 * k));
+            __m128i vb = _mm_loadu_si128(
+                (const __m128i *)(b + i * BITMAP_BPP + 16 * k));
+            __m128i d = _mm_or_si128(
+                _mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+            __m128i lo = _mm_unpacklo_epi8(d, zero),
+                    hi = _mm_unpackhi_epi8(d, zero);
+
+            vmax = _mm_max_epu8(vmax, d);
+            vsse = _mm_add_epi32(vsse,
+                _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+            mask |= (uint64_t)(~_mm_movemask_epi8(_mm_cmpeq_epi8(
+                                   _mm_subs_epu8(d, thr), zero))
+                       & 0xffff)
+                << (16 * k);
+        }
+
+        mask = (mask | mask >> 1 | mask >> 2) & 0x249249249249ull;
+        for (; mask; mask &= mask - 1)
+            changed++;
+    }
+
+    uint8_t maxes[16];
+    uint32_t sums[4];
+    _mm_storeu_si128((__m128i *)maxes, vmax);
+    _mm_storeu_si128((__m128i *)sums, vsse);
+    for (int k = 0; k < 16; k++)
+        *max_delta = maxes[k] > *max_delta ? maxes[k] : *max_delta;
+    *sse += (uint64_t)sums[0] + sums[1] + sums[2] + sums[3];
+#endif
+
+    for (; i < n; i++) {
+        int pixel_delta = 0;
+        for (int c = 0; c < BITMAP_BPP; c++) {
+            int d = abs(a[i * BITMAP_BPP + c] - b[i * BITMAP_BPP + c]);
+            pixel_delta = d > pixel_delta ? d : pixel_delta;
+            *sse += (uint64_t)(d * d);
+        }
+        *max_delta = pixel_delta > *max_delta ? pixel_delta : *max_delta;
+        changed += pixel_delta > threshold;
+    }
+
+    return changed;
+}
+
+/* Compares two rectangles of pixels.
+ * Returns 1 if they are equal, 0 otherwise
+ * @a: First row of the first rectangle
+ * @b: First row of the second rectangle
+ * @stride: Distance between rows of both rectangles in bytes
+ * @len: Length of every row in bytes
+ * @h: Number of rows
+ */
+static int spans_equal(const uint8_t *a, const uint8_t *b, size_t stride,
+    size_t len, int h)
+{
+    for (int y = 0; y < h; y++, a += stride, b += stride) {
+        size_t i = 0;
+#ifdef HAVE_SSE2
+        /* OR together the differences of a whole row before testing. */
+        __m128i diff = _mm_setzero_si128();
+        for (; i + 16 <= len; i += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+            diff = _mm_or_si128(diff, _mm_xor_si128(va, vb));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()))
+            != 0xffff)
+            return 0;
+#endif
+        if (memcmp(a + i, b + i, len - i))
+            return 0;
+    }
+    return 1;
+}
+
+/* Rows read at a time when gathering statistics, few enough for a band to
+ * still be in cache when it is accumulated. */
+#define STATS_BAND_ROWS 32
+
+/* Accumulates the statistics of a strip of rows.
+ * @stats: Statistics to be updated
+ * @buf: Rows
+ * @row_start: Index of the first row
+ * @row_end: One past the index of the last row
+ */
+static void accumulate_stats(struct image_stats *stats, const uint8_t *buf,
+    int row_start, int row_end)
+{
+    for (int y = row_start; y < row_end; y++) {
+        const uint8_t *row = buf + (size_t)(y - row_start) * BITMAP_STRIDE;
+        uint64_t sum[3] = { 0, 0, 0 }, sum_sq[3] = { 0, 0, 0 };
+
+        for (int x = 0; x < BITMAP_WIDTH; x++) {
+            for (int c = 0; c < 3; c++) {
+                unsigned v = row[x * BITMAP_BPP + c];
+                sum[c] += v;
+                sum_sq[c] += v * v;
+                stats->hist[c][v]++;
+                stats->min[c] = (int)v < stats->min[c] ? (int)v : stats->min[c];
+                stats->max[c] = (int)v > stats->max[c] ? (int)v : stats->max[c];
+            }
+        }
+
+        for (int c = 0; c < 3; c++) {
+            stats->sum[c] += sum[c];
+            stats->sum_sq[c] += sum_sq[c];
+        }
+        stats->hash += xxh64(row, BITMAP_STRIDE, (uint64_t)y);
+    }
+    stats->num_pixels += (uint64_t)(row_end - row_start) * BITMAP_WIDTH;
+}
+
+#ifndef _WIN32
+/* CPUs this process was allowed to run on at startup, in increasing
+ * order. */
+static int g_cpus[MAX_CPUS], g_num_cpus;
+
+/* Threads of every process are numbered as places for --affinity:
+ * renderers come first, then every thread of every worker in rank order.
+ * This process' threads start at g_first_place. */
+static int g_first_place, g_num_places = 1;
+
+/* Records the CPUs this process may run on, before any of its threads gets
+ * pinned to one of them.
+ */
+static void init_affinity(void)
+{
+    cpu_set_t set;
+    if (!g_opts.affinity || sched_getaffinity(0, sizeof(set), &set))
+        return;
+    for (int cpu = 0; cpu < CPU_SETSIZE && g_num_cpus < MAX_CPUS; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            g_cpus[g_num_cpus++] = cpu;
+    }
+}
+
+/* Pins the calling thread to a CPU, as per --affinity.
+ * @place: Place of the thread among those of this process
+ */
+static void pin_thread(int place)
+{
+    int cpu;
+    place += g_first_place;
+    switch (g_opts.affinity) {
+    case AFFINITY_COMPACT:
+        if (!g_num_cpus)
+            return;
+        cpu = g_cpus[place % g_num_cpus];
+        break;
+    case AFFINITY_SCATTER:
+        if (!g_num_cpus)
+            return;
+        cpu = g_cpus[(long)place * g_num_cpus / g_num_places % g_num_cpus];
+        break;
+    case AFFINITY_LIST:
+        cpu = g_opts.cpus[place % g_opts.num_cpus];
+        break;
+    default:
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set))
+        errf("could not pin thread to CPU %d: %s", cpu, strerror(errno));
+}
+#endif
+
+/* Chase-Lev work-stealing deque of task indices. Its owner pushes and pops
+ * tasks at the bottom, while other threads steal them from the top. */
+struct task_deque {
+    long top, bottom;
+    long mask; /* capacity minus one, a power of two minus one */
+    int *tasks;
+    struct thread_pool *pool;
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+};
+
+/* Threads of a worker that filters its rows in parallel. The thread that
+ * created the pool owns the first deque and takes part in every run, and
+ * is the only one making MPI calls. */
+struct thread_pool {
+    int num_threads;
+    struct task_deque *deques;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t start, finish;
+#endif
+    unsigned generation; /* bumped on every run */
+    int num_busy; /* threads other than the owner still running tasks */
+    int quit;
+    void (*fn)(void *arg, int task);
+    void *arg;
+};
+
+/* Pushes a task onto the bottom of a deque. Only its owner may call this.
+ * @d: Deque, which must have room for the task
+ * @task: Task index
+ */
+static void deque_push(struct task_deque *d, int task)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->tasks[b & d->mask], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/* Pops a task off the bottom of a deque. Only its owner may call this.
+ * Returns the task index, or -1 if the deque is empty
+ * @d: Deque
+ */
+static int deque_pop(struct task_deque *d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    /* Race thieves for the last task. */
+    int task = __atomic_load_n(&d->tasks[b & d->mask], __ATOMIC_RELAXED);
+    if (t == b) {
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = -1;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/* Steals a task from the top of a deque.
+ * Returns the task index, -1 if the deque is empty, or -2 if another
+ * thread took the task first
+ * @d: Deque
+ */
+static int deque_steal(struct task_deque *d)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return -1;
+
+    int task = __atomic_load_n(&d->tasks[t & d->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(
+            &d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return -2;
+    return task;
+}
+
+/* Runs the tasks of a thread's own deque, then steals from the others
+ * until every deque is empty. No tasks get pushed during a run, so empty
+ * deques stay that way.
+ * @pool: Thread pool
+ * @self: Index of the calling thread
+ */
+static void run_tasks(struct thread_pool *pool, int self)
+{
+    for (;;) {
+        int task = deque_pop(&pool->deques[self]);
+        for (int i = 1; task < 0 && i < pool->num_threads; i++) {
+            struct task_deque *victim
+                = &pool->deques[(self + i) % pool->num_threads];
+            while ((task = deque_steal(victim)) == -2)
+                ;
+        }
+        if (task < 0)
+            return;
+        pool->fn(pool->arg, task);
+    }
+}
+
+#ifndef _WIN32
+/* Thread body of every pool thread but the owner.
+ * Returns NULL
+ * @arg: Deque of the thread
+ */
+static void *pool_thread(void *arg)
+{
+    struct task_deque *d = arg;
+    struct thread_pool *pool = d->pool;
+    unsigned seen = 0;
+
+    pin_thread((int)(d - pool->deques));
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
+            break;
+
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        run_tasks(pool, (int)(d - pool->deques));
+        pthread_mutex_lock(&pool->lock);
+        if (!--pool->num_busy)
+            pthread_cond_signal(&pool->finish);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+#endif
+
+/* Starts a pool of threads, counting the calling one.
+ * Returns the pool, or NULL if it would have a single thread
+ * @num_threads: Number of threads
+ */
+static struct thread_pool *create_pool(int num_threads)
+{
+#ifdef _WIN32
+    (void)num_threads;
+    return NULL;
+#else
+    if (num_threads < 2)
+        return NULL;
+
+    struct thread_pool *pool = calloc(1, sizeof(*pool));
+    pool->deques = calloc(num_threads, sizeof(struct task_deque));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+    pool->num_threads = 1;
+    pool->deques[0].pool = pool;
+    for (int i = 1; i < num_threads; i++, pool->num_threads++) {
+        struct task_deque *d = &pool->deques[i];
+        d->pool = pool;
+        if (pthread_create(&d->thread, NULL, pool_thread, d)) {
+            errf("could not create thread %d, going on with %d", i, i);
+            break;
+        }
+    }
+    return pool;
+#endif
+}
+
+/* Stops and frees a thread pool.
+ * @pool: Thread pool, may be NULL
+ */
+static void destroy_pool(struct thread_pool *pool)
+{
+#ifdef _WIN32
+    (void)pool;
+#else
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->num_threads; i++) {
+        if (i)
+            pthread_join(pool->deques[i].thread, NULL);
+        free(pool->deques[i].tasks);
+    }
+    pthread_cond_destroy(&pool->finish);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deques);
+    free(pool);
+#endif
+}
+
+/* Runs a number of independent tasks on a thread pool, and waits for them
+ * to complete. Threads start off with consecutive tasks, and steal from
+ * each other once they run out.
+ * @pool: Thread pool, NULL to run the tasks on the calling thread
+ * @num_tasks: Number of tasks
+ * @fn: Function running a task, given @arg and the task index
+ * @arg: Argument to @fn
+ */
+static void pool_run(struct thread_pool *pool, int num_tasks,
+    void (*fn)(void *arg, int task), void *arg)
+{
+#ifndef _WIN32
+    if (pool && num_tasks > 1) {
+        /* Deques are idle in between runs, so they can grow then. */
+        long capacity = pool->deques[0].mask + 1;
+        if (!pool->deques[0].tasks || capacity < num_tasks) {
+            while (capacity < num_tasks)
+                capacity *= 2;
+            for (int i = 0; i < pool->num_threads; i++) {
+                struct task_deque *d = &pool->deques[i];
+                free(d->tasks);
+                d->tasks = malloc(capacity * sizeof(int));
+                d->mask = capacity - 1;
+            }
+            g_num_allocs += pool->num_threads;
+        }
+
+        /* Push in reverse, so every thread pops its tasks in order. */
+        for (int i = 0; i < pool->num_threads; i++) {
+            struct task_deque *d = &pool->deques[i];
+            d->top = d->bottom = 0;
+            int first = (int)((long)num_tasks * i / pool->num_threads),
+                last = (int)((long)num_tasks * (i + 1) / pool->num_threads);
+            for (int task = last - 1; task >= first; task--)
+                deque_push(d, task);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->fn = fn;
+        pool->arg = arg;
+        pool->generation++;
+        pool->num_busy = pool->num_threads - 1;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool, 0);
+        pthread_mutex_lock(&pool->lock);
+        while (pool->num_busy)
+            pthread_cond_wait(&pool->finish, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+#else
+    (void)pool;
+#endif
+    for (int task = 0; task < num_tasks; task++)
+        fn(arg, task);
+}
+
+/* Rows processed in parallel, a band of TILE_SIZE rows per task. */
+struct band_job {
+    uint8_t *buf;
+    uint8_t *const *layer_bufs;
+    const int *layer_bpp;
+    const struct filter *stages;
+    size_t num_stages;
+    int num_rows;
+};
+
+/* Composites the layers over a band of rows.
+ * @arg: Band job
+ * @band: Band index
+ */
+static void composite_band(void *arg, int band)
+{
+    const struct band_job *job = arg;
+    size_t first = (size_t)band * TILE_SIZE * BITMAP_WIDTH;
+    uint8_t *layer_bufs[MAX_LAYERS];
+    for (size_t l = 0; l < g_opts.num_layers; l++)
+        layer_bufs[l] = job->layer_bufs[l] + first * job->layer_bpp[l];
+    composite_layers(job->buf + first * BITMAP_BPP, layer_bufs,
+        job->layer_bpp,
+        (size_t)min(TILE_SIZE, job->num_rows - band * TILE_SIZE)
+            * BITMAP_WIDTH);
+}
+
+/* Runs a band of rows through a run of point filters.
+ * @arg: Band job
+ * @band: Band index
+ */
+static void filter_band(void *arg, int band)
+{
+    const struct band_job *job = arg;
+    size_t first = (size_t)band * TILE_SIZE * BITMAP_WIDTH;
+    apply_point_filters(job->buf + first * BITMAP_BPP,
+        (size_t)min(TILE_SIZE, job->num_rows - band * TILE_SIZE)
+            * BITMAP_WIDTH,
+        job->stages, job->num_stages);
+}
+
+/* Runs a band of rows through a temporal filter stage, whose history is
+ * ready for the frame.
+ * @arg: Band job
+ * @band: Band index
+ */
+static void temporal_band(void *arg, int band)
+{
+    const struct band_job *job = arg;
+    size_t first = (size_t)band * TILE_SIZE * BITMAP_STRIDE;
+    apply_temporal_range(job->buf, first,
+        first
+            + (size_t)min(TILE_SIZE, job->num_rows - band * TILE_SIZE)
+                * BITMAP_STRIDE,
+        job->stages);
+}
+
+/* Zeroes a band of rows.
+ * @arg: Band job
+ * @band: Band index
+ */
+static void touch_band(void *arg, int band)
+{
+    const struct band_job *job = arg;
+    memset(job->buf + (size_t)band * TILE_SIZE * BITMAP_STRIDE, 0,
+        (size_t)min(TILE_SIZE, job->num_rows - band * TILE_SIZE)
+            * BITMAP_STRIDE);
+}
+
+/* Touches every page of a freshly allocated buffer of rows from the pool
+ * thread that is going to filter them, so that pinned threads get their
+ * bands placed on their own NUMA node.
+ * @buf: Buffer of rows
+ * @num_rows: Number of rows in the buffer
+ */
+static void first_touch(uint8_t *buf, int num_rows)
+{
+    if (!g_pool || !g_opts.affinity)
+        return;
+
+    struct band_job job = { buf, NULL, NULL, NULL, 0, num_rows };
+    pool_run(g_pool, (num_rows + TILE_SIZE - 1) / TILE_SIZE, touch_band,
+        &job);
+}
+
+/* Opens an image file and works out the rows owned by this worker. This
+ * is a collective operation.
+ * @path: Path to the file containing the data
+ * @input_file: Filled in with the open file
+ * @num_rows: Number of rows in the image; the file must have as many if
+ *            non-zero on entry
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ */
+static void open_rows(const char *path, MPI_File *input_file, int *num_rows,
+    int *row_start, int *row_end)
+{
+    /* Open input file. */
+    logf("opening file `%s' for reading", path);
+    MPI_Check(MPI_File_open(MPI_COMM_WORLD, path, MPI_MODE_RDONLY,
+        MPI_INFO_NULL, input_file));
+
+    /* Calculate chunk length for each peer. */
+    MPI_Offset input_len;
+    MPI_Check_close(input_file, MPI_File_get_size(*input_file, &input_len));
+    if (input_len % BITMAP_STRIDE
+        || (*num_rows && input_len != (MPI_Offset)*num_rows * BITMAP_STRIDE)) {
+        if (*num_rows) {
+            errf("invalid length of `%s'. Expected %lld but got %lld.", path,
+                (MPI_Offset)*num_rows * BITMAP_STRIDE, input_len);
+        } else {
+            errf("invalid input length. Expected a multiple of %d but got "
+                 "%lld.",
+                BITMAP_STRIDE, input_len);
+        }
+        MPI_File_close(input_file);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+
+    *num_rows = (int)(input_len / BITMAP_STRIDE);
+    worker_rows(g_rank, *num_rows, row_start, row_end);
+
+    MPI_Offset chunk_start = (MPI_Offset)*row_start * BITMAP_STRIDE,
+               chunk_len
+        = (MPI_Offset)(*row_end - *row_start) * BITMAP_STRIDE;
+    logf("%lld bytes: [%lld, %lld]", chunk_len, chunk_start,
+        chunk_start + chunk_len - 1);
+}
+
+/* Reads the rows owned by this worker from an image file. This is a
+ * collective operation.
+ * Returns a newly allocated buffer holding the rows
+ * @path: Path to the file containing the data
+ * @stats: Statistics to accumulate the rows into as read, may be NULL
+ * @num_rows: Number of rows in the image; the file must have as many if
+ *            non-zero on entry
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ */
+static uint8_t *read_rows(const char *path, struct image_stats *stats,
+    int *num_rows, int *row_start, int *row_end)
+{
+    MPI_File input_file;
+    open_rows(path, &input_file, num_rows, row_start, row_end);
+    MPI_Offset chunk_start = (MPI_Offset)*row_start * BITMAP_STRIDE,
+               chunk_len
+        = (MPI_Offset)(*row_end - *row_start) * BITMAP_STRIDE;
+
+    /* Allocate buffer for reading chunk. */
+    uint8_t *buf = alloc_buffer(chunk_len);
+    first_touch(buf, *row_end - *row_start);
+
+    /* Read from file. Statistics are gathered a band at a time, while the
+     * band just read is still in cache. */
+    if (stats) {
+        for (int y = *row_start; y < *row_end; y += STATS_BAND_ROWS) {
+            int band_end = y + STATS_BAND_ROWS < *row_end
+                ? y + STATS_BAND_ROWS
+                : *row_end;
+            uint8_t *band = buf + (size_t)(y - *row_start) * BITMAP_STRIDE;
+            MPI_Check(MPI_File_read_at(input_file,
+                (MPI_Offset)y * BITMAP_STRIDE, band,
+                (band_end - y) * BITMAP_STRIDE, MPI_BYTE, MPI_STATUS_IGNORE));
+            accumulate_stats(stats, band, y, band_end);
+        }
+    } else {
+        MPI_Check(MPI_File_read_at_all(input_file, chunk_start, buf,
+            (int)chunk_len, MPI_BYTE, MPI_STATUS_IGNORE));
+    }
+    MPI_Check(MPI_File_close(&input_file));
+
+    return buf;
+}
+
+/* Reads the rows owned by this worker from every layer. This is a
+ * collective operation.
+ * @layer_bufs: Filled in with newly allocated buffers holding the rows
+ * @layer_bpp: Filled in with the bytes per pixel of every layer
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @num_rows: Number of rows in the input file
+ */
+static void read_layers(uint8_t **layer_bufs, int *layer_bpp, int row_start,
+    int row_end, int num_rows)
+{
+    for (size_t l = 0; l < g_opts.num_layers; l++) {
+        layer_bufs[l] = read_layer(
+            &g_opts.layers[l], row_start, row_end, num_rows, &layer_bpp[l]);
+    }
+}
+
+/* Composites the layers over the rows owned by this worker and runs them
+ * through the filter chain, in place. This is a collective operation.
+ * @buf: Rows owned by this worker
+ * @layer_bufs: Rows of every layer
+ * @layer_bpp: Bytes per pixel of every layer
+ * @chain: Filter chain
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @num_rows: Number of rows in the image
+ */
+static void process_rows(uint8_t *buf, uint8_t *const *layer_bufs,
+    const int *layer_bpp, struct filter_chain *chain, int row_start,
+    int row_end, int num_rows)
+{
+    /* Layers, point filters and temporal filters are applied band by band
+     * on the thread pool, if there's one. */
+    size_t strides = (size_t)(row_end - row_start) * BITMAP_WIDTH;
+    struct band_job job = { buf, layer_bufs, layer_bpp, NULL, 0,
+        row_end - row_start };
+    int num_bands = (row_end - row_start + TILE_SIZE - 1) / TILE_SIZE;
+    if (g_opts.num_layers) {
+        /* Composite the same rows of every layer over ours. */
+        pool_run(g_pool, num_bands, composite_band, &job);
+    }
+
+    /* Apply filters as per the supplied filter string. Point filters are
+     * applied in runs, temporal filters look back at our rows of previous
+     * frames, and warps need the whole image and run collectively. */
+    for (size_t i = 0; i < chain->len;) {
+        size_t j = i;
+        while (j < chain->len && is_point_filter(&chain->stages[j]))
+            j++;
+
+        if (j > i) {
+            job.buf = buf;
+            job.stages = chain->stages + i;
+            job.num_stages = j - i;
+            pool_run(g_pool, num_bands, filter_band, &job);
+            i = j;
+        } else if (is_temporal_filter(&chain->stages[i])) {
+            /* Histories are indexed by byte offset, and bands don't
+             * overlap. */
+            prepare_history(&chain->stages[i], strides * BITMAP_BPP);
+            job.buf = buf;
+            job.stages = &chain->stages[i];
+            job.num_stages = 1;
+            pool_run(g_pool, num_bands, temporal_band, &job);
+            advance_history(&chain->stages[i++]);
+        } else {
+            warp_strip(
+                buf, row_start, row_end, num_rows, &chain->stages[i++]);
+        }
+    }
+}
+
+/* Tells every renderer this worker won't send any more pixels for now.
+ * @parent_comm: Communicator to the renderers
+ */
+static void send_done(MPI_Comm parent_comm)
+{
+    for (int r = 0; r < g_num_renderers; r++)
+        MPI_Check(MPI_Send(NULL, 0, MPI_BYTE, r, TAG_DONE, parent_comm));
+}
+
+/* Compares our rows of the input file against the reference image and
+ * sends the tiles that changed to the renderer, highlighting the pixels
+ * that differ. Global statistics are reduced on the renderer.
+ * @buf: Rows of the input file
+ * @ref: Rows of the reference image
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @parent_comm: Communicator to the renderer
+ */
+static void send_diff(const uint8_t *buf, const uint8_t *ref, int row_start,
+    int row_end, MPI_Comm parent_comm)
+{
+    uint64_t sums[3] = { 0, 0, 0 }; /* changed pixels, squared error, pixels */
+    int max_delta = 0, threshold = g_opts.diff_threshold;
+
+    for (int ty = row_start; ty < row_end; ty += TILE_SIZE) {
+        for (int tx = 0; tx < BITMAP_WIDTH; tx += TILE_SIZE) {
+            int w = min(TILE_SIZE, BITMAP_WIDTH - tx),
+                h = min(TILE_SIZE, row_end - ty);
+            size_t changed = 0;
+            for (int y = 0; y < h; y++) {
+                size_t off = (size_t)(ty + y - row_start) * BITMAP_STRIDE
+                    + (size_t)tx * BITMAP_BPP;
+                changed += diff_span(
+                    buf + off, ref + off, w, threshold, &sums[1], &max_delta);
+            }
+
+            sums[0] += changed;
+            sums[2] += (uint64_t)w * h;
+            if (!changed)
+                continue;
+
+            struct tile_header *tile = get_msg(&g_msg_pool);
+            uint8_t *pixels = (uint8_t *)(tile + 1);
+            tile->x = (uint16_t)tx;
+            tile->y = (uint16_t)ty;
+            tile->w = (uint16_t)w;
+            tile->h = (uint16_t)h;
+            tile->scale = 0;
+
+            /* Dim the tile and highlight the pixels that changed. */
+            for (int y = 0; y < tile->h; y++) {
+                for (int x = 0; x < tile->w; x++) {
+                    size_t off = (size_t)(ty + y - row_start) * BITMAP_STRIDE
+                        + (size_t)(tx + x) * BITMAP_BPP;
+                    uint8_t *p = pixels + (y * tile->w + x) * BITMAP_BPP;
+                    int delta = 0;
+                    for (int c = 0; c < BITMAP_BPP; c++) {
+                        int d = abs(buf[off + c] - ref[off + c]);
+                        delta = d > delta ? d : delta;
+                        p[c] = buf[off + c] >> 2;
+                    }
+                    if (delta > threshold)
+                        p[0] = 0xff;
+                }
+            }
+
+            post_msg(&g_msg_pool, tile,
+                sizeof(*tile) + (size_t)w * h * BITMAP_BPP, parent_comm);
+        }
+    }
+
+    send_done(parent_comm);
+    MPI_Check(
+        MPI_Reduce(sums, NULL, 3, MPI_UINT64_T, MPI_SUM, 0, parent_comm));
+    MPI_Check(
+        MPI_Reduce(&max_delta, NULL, 1, MPI_INT, MPI_MAX, 0, parent_comm));
+}
+
+/* Halves the resolution of a block of pixels, averaging every 2x2 square.
+ * Odd edges are averaged with themselves.
+ * @dest: Output buffer, of (w + 1) / 2 by (h + 1) / 2 packed RGB triplets
+ * @src: Input pixels
+ * @stride: Distance in bytes between the rows of @src
+ * @w: Width of @src, up to BITMAP_WIDTH
+ * @h: Height of @src
+ */
+static void box_reduce(
+    uint8_t *dest, const uint8_t *src, size_t stride, int w, int h)
+{
+    uint16_t sums[BITMAP_STRIDE];
+    size_t len = (size_t)w * BITMAP_BPP;
+    for (int y = 0; y < h; y += 2) {
+        const uint8_t *row0 = src + y * stride,
+                      *row1 = y + 1 < h ? row0 + stride : row0;
+
+        /* Add up pairs of rows first, 16 bytes at a time. */
+        size_t i = 0;
+#ifdef HAVE_SSE2
+        __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= len; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(row0 + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(row1 + i));
+            _mm_storeu_si128((__m128i *)(sums + i),
+                _mm_add_epi16(
+                    _mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+            _mm_storeu_si128((__m128i *)(sums + i + 8),
+                _mm_add_epi16(
+                    _mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+        }
+#endif
+        for (; i < len; i++)
+            sums[i] = (uint16_t)(row0[i] + row1[i]);
+
+        for (int x = 0; x < w; x += 2) {
+            int x0 = x * BITMAP_BPP,
+                x1 = (x + 1 < w ? x + 1 : x) * BITMAP_BPP;
+            for (int c = 0; c < BITMAP_BPP; c++)
+                *dest++ = (uint8_t)((sums[x0 + c] + sums[x1 + c] + 2) >> 2);
+        }
+    }
+}
+
+/* Packs the pixels of a tile right after its header, downscaled as told by
+ * the header.
+ * Returns the length of the tile message
+ * @tile: Position, size and scale of the tile, followed by room for its
+ * pixels. Downscaled tiles may be no larger than TILE_SIZE.
+ * @src: First pixel of the tile
+ * @stride: Distance in bytes between the rows of @src
+ */
+static size_t pack_tile(
+    struct tile_header *tile, const uint8_t *src, size_t stride)
+{
+    uint8_t *pixels = (uint8_t *)(tile + 1);
+    int w = tile->w, h = tile->h;
+    if (!tile->scale) {
+        size_t row_len = (size_t)w * BITMAP_BPP;
+        for (int y = 0; y < h; y++)
+            memcpy(pixels + y * row_len, src + y * stride, row_len);
+        return sizeof(*tile) + h * row_len;
+    }
+
+    /* Halve it as many times as needed, going back and forth between two
+     * scratch buffers. */
+    uint8_t scratch[2][TILE_BYTES / 4];
+    for (int s = 0; s < tile->scale; s++) {
+        uint8_t *dest = s == tile->scale - 1 ? pixels : scratch[s % 2];
+        box_reduce(dest, src, stride, w, h);
+        src = dest;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        stride = (size_t)w * BITMAP_BPP;
+    }
+    return sizeof(*tile) + (size_t)w * h * BITMAP_BPP;
+}
+
+/* Sends a rectangle of rows to the renderer as a tile, out of the message
+ * pool.
+ * @buf: Rows owned by this worker
+ * @row_start: First row owned by this worker
+ * @x: Left edge of the tile
+ * @y: Top edge of the tile
+ * @w: Width of the tile
+ * @h: Height of the tile
+ * @scale: Resolution to send the tile at, as a power of two to divide by
+ * @parent_comm: Communicator to the renderer
+ */
+static void send_tile(const uint8_t *buf, int row_start, int x, int y, int w,
+    int h, int scale, MPI_Comm parent_comm)
+{
+    struct tile_header *tile = get_msg(&g_msg_pool);
+    tile->x = (uint16_t)x;
+    tile->y = (uint16_t)y;
+    tile->w = (uint16_t)w;
+    tile->h = (uint16_t)h;
+    tile->scale = (uint16_t)scale;
+    size_t len = pack_tile(tile,
+        buf + (size_t)(y - row_start) * BITMAP_STRIDE + (size_t)x * BITMAP_BPP,
+        BITMAP_STRIDE);
+    post_msg(&g_msg_pool, tile, len, parent_comm);
+}
+
+/* Sends rows to the renderer as full-width tiles of up to TILE_SIZE rows.
+ * @buf: Rows owned by this worker
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @parent_comm: Communicator to the renderer
+ */
+static void send_tiles(const uint8_t *buf, int row_start, int row_end,
+    MPI_Comm parent_comm)
+{
+    for (int y = row_start; y < row_end; y += TILE_SIZE) {
+        send_tile(buf, row_start, 0, y, BITMAP_WIDTH,
+            min(TILE_SIZE, row_end - y), 0, parent_comm);
+    }
+}
+
+/* Sends rows to the renderer coarse to fine: every tile at 1/2^scale of
+ * its resolution first, then at twice that resolution, and so on until
+ * it's sent at full resolution. Workers wait for each other between
+ * passes so that the whole image shows up at once, if blurry.
+ * @buf: Rows owned by this worker
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @parent_comm: Communicator to the renderer
+ */
+static void send_progressive(const uint8_t *buf, int row_start,
+    int row_end, MPI_Comm parent_comm)
+{
+    for (int scale = PROGRESSIVE_SCALE; scale >= 0; scale--) {
+        for (int ty = row_start; ty < row_end; ty += TILE_SIZE) {
+            for (int tx = 0; tx < BITMAP_WIDTH; tx += TILE_SIZE) {
+                send_tile(buf, row_start, tx, ty,
+                    min(TILE_SIZE, BITMAP_WIDTH - tx),
+                    min(TILE_SIZE, row_end - ty), scale, parent_comm);
+            }
+        }
+        if (scale)
+            MPI_Check(MPI_Barrier(MPI_COMM_WORLD));
+    }
+}
+
+/* Sends rows to the renderer zoomed out to 1/2^g_opts.zoom of their size,
+ * through a pyramid of ever smaller copies of them. Rows that wouldn't fit
+ * in the window once zoomed out are left alone. The pyramid is never saved,
+ * so every run reads and filters all of the input before zooming out.
+ * @buf: Rows owned by this worker
+ * @row_start: First row owned by this worker, a multiple of 2^g_opts.zoom
+ * @row_end: One past the last row owned by this worker
+ * @parent_comm: Communicator to the renderer
+ */
+static void send_zoomed(const uint8_t *buf, int row_start, int row_end,
+    MPI_Comm parent_comm)
+{
+    int zoom = g_opts.zoom, level_start = row_start >> zoom;
+    if (level_start >= BITMAP_HEIGHT)
+        return;
+
+    /* Build the pyramid level by level, down to the one we're after. */
+    uint8_t *levels[ZOOM_MAX + 1];
+    int w = BITMAP_WIDTH, h = row_end - row_start;
+    levels[0] = (uint8_t *)buf;
+    for (int l = 1; l <= zoom; l++) {
+        levels[l]
+            = alloc_buffer((size_t)((w + 1) / 2) * ((h + 1) / 2) * BITMAP_BPP);
+        box_reduce(levels[l], levels[l - 1], (size_t)w * BITMAP_BPP, w, h);
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+
+    int level_end = min(level_start + h, BITMAP_HEIGHT);
+    size_t stride = (size_t)w * BITMAP_BPP;
+    for (int ty = level_start; ty < level_end; ty += TILE_SIZE) {
+        for (int tx = 0; tx < w; tx += TILE_SIZE) {
+            struct tile_header *tile = get_msg(&g_msg_pool);
+            tile->x = (uint16_t)tx;
+            tile->y = (uint16_t)ty;
+            tile->w = (uint16_t)min(TILE_SIZE, w - tx);
+            tile->h = (uint16_t)min(TILE_SIZE, level_end - ty);
+            tile->scale = 0;
+            size_t len = pack_tile(tile,
+                levels[zoom] + (size_t)(ty - level_start) * stride
+                    + (size_t)tx * BITMAP_BPP,
+                stride);
+            post_msg(&g_msg_pool, tile, len, parent_comm);
+        }
+    }
+
+    for (int l = 1; l <= zoom; l++)
+        free_buffer(levels[l]);
+}
+
+/* Writes a canonical description of a filter chain, so that equivalent
+ * filter strings map to the same result cache entries.
+ * Returns the length of the description
+ * @chain: Filter chain
+ * @dest: Output buffer
+ * @len: Size of the output buffer
+ */
+static int format_filter_chain(const struct filter_chain *chain, char *dest,
+    size_t len)
+{
+    int n = 0;
+    for (size_t i = 0; i < chain->len && (size_t)n < len; i++) {
+        const struct filter *f = &chain->stages[i];
+        if (f->lut) {
+            /* Describe LUTs by their contents rather than their path. */
+            const struct lut3d *lut = f->lut;
+            uint64_t hash = xxh64(lut->entries,
+                (size_t)lut->size * lut->size * lut->size * sizeof(uint32_t),
+                xxh64(lut->domain_max, sizeof(lut->domain_max),
+                    xxh64(lut->domain_min, sizeof(lut->domain_min), 0)));
+            n += snprintf(dest + n, len - n, "u(%016llx)",
+                (unsigned long long)hash);
+            continue;
+        }
+
+        n += snprintf(dest + n, len - n, "%c", f->op);
+        for (int a = 0; a < f->num_args && (size_t)n < len; a++)
+            n += snprintf(dest + n, len - n, "%c%.17g", a ? ',' : '(',
+                f->args[a]);
+        if (f->num_args && (size_t)n < len)
+            n += snprintf(dest + n, len - n, ")");
+    }
+    return n;
+}
+
+/* Computes the key of the result cache entry for the current run: a hash
+ * of the input and layer contents, the image geometry, the layer blend
+ * modes, the normalized filter chain and the cache format version. This is
+ * a collective operation.
+ * @buf: Rows of the input file owned by this worker
+ * @layer_bufs: Rows of every layer owned by this worker
+ * @layer_bpp: Bytes per pixel of every layer
+ * @chain: Filter chain
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @num_rows: Number of rows in the image
+ */
+static uint64_t cache_key(const uint8_t *buf, uint8_t *const *layer_bufs,
+    const int *layer_bpp, const struct filter_chain *chain, int row_start,
+    int row_end, int num_rows)
+{
+    uint64_t hashes[1 + MAX_LAYERS];
+    int num_hashes = 1 + (int)g_opts.num_layers;
+    for (int h = 0; h < num_hashes; h++) {
+        const uint8_t *rows = h ? layer_bufs[h - 1] : buf;
+        size_t stride = h ? (size_t)BITMAP_WIDTH * layer_bpp[h - 1]
+                          : BITMAP_STRIDE;
+        hashes[h] = 0;
+        for (int y = row_start; y < row_end; y++) {
+            hashes[h]
+                += xxh64(rows + (size_t)(y - row_start) * stride, stride, y);
+        }
+    }
+    MPI_Check(MPI_Allreduce(MPI_IN_PLACE, hashes, num_hashes, MPI_UINT64_T,
+        MPI_SUM, MPI_COMM_WORLD));
+
+    char desc[BUFSIZ];
+    int n = snprintf(desc, sizeof(desc), "v%d %dx%d", CACHE_FORMAT_VERSION,
+        BITMAP_WIDTH, num_rows);
+    for (int h = 0; h < num_hashes; h++) {
+        n += snprintf(desc + n, sizeof(desc) - n, " %016llx",
+            (unsigned long long)hashes[h]);
+        if (h) {
+            n += snprintf(desc + n, sizeof(desc) - n, ":%d@%.17g",
+                g_opts.layers[h - 1].mode, g_opts.layers[h - 1].opacity);
+        }
+    }
+    n += snprintf(desc + n, sizeof(desc) - n, " ");
+    n += format_filter_chain(chain, desc + n, sizeof(desc) - n);
+    return xxh64(desc, min((size_t)n, sizeof(desc) - 1), 0);
+}
+
+/* Builds the path of the result cache entry for a key.
+ * @dest: Output buffer, FILENAME_MAX bytes long
+ * @key: Cache key
+ */
+static void cache_path(char *dest, uint64_t key)
+{
+    snprintf(dest, FILENAME_MAX, "%s/%016llx.rgb", g_opts.cache_dir,
+        (unsigned long long)key);
+}
+
+/* Looks filtered rows up in the result cache. Entries hold the whole
+ * filtered image, so any number of workers can share them. This is a
+ * collective operation.
+ * Returns a buffer holding the rows, to be freed with free_buffer(), or
+ * NULL on a miss
+ * @key: Cache key
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @num_rows: Number of rows in the image
+ */
+static uint8_t *cache_lookup(
+    uint64_t key, int row_start, int row_end, int num_rows)
+{
+    char path[FILENAME_MAX];
+    cache_path(path, key);
+
+    /* The entry must hold exactly the whole image. */
+    int hit = 0;
+    if (g_rank == 0) {
+        MPI_File file;
+        MPI_Offset len;
+        if (MPI_File_open(MPI_COMM_SELF, path, MPI_MODE_RDONLY,
+                MPI_INFO_NULL, &file)
+            == MPI_SUCCESS) {
+            hit = MPI_File_get_size(file, &len) == MPI_SUCCESS
+                && len == (MPI_Offset)num_rows * BITMAP_STRIDE;
+            MPI_File_close(&file);
+        }
+    }
+
+    MPI_Check(MPI_Bcast(&hit, 1, MPI_INT, 0, MPI_COMM_WORLD));
+    if (!hit)
+        return NULL;
+
+    MPI_File file;
+    MPI_Check(MPI_File_open(
+        MPI_COMM_WORLD, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &file));
+
+    size_t len = (size_t)(row_end - row_start) * BITMAP_STRIDE;
+    uint8_t *buf = alloc_buffer(len);
+    MPI_Check_close(&file,
+        MPI_File_read_at_all(file, (MPI_Offset)row_start * BITMAP_STRIDE, buf,
+            (int)len, MPI_BYTE, MPI_STATUS_IGNORE));
+    MPI_Check(MPI_File_close(&file));
+    return buf;
+}
+
+/* Stores the filtered image in the result cache. Every worker writes its
+ * rows to a temporary file, which is renamed into place once complete so
+ * that readers never see partial entries. This is a collective operation.
+ * @key: Cache key
+ * @buf: Filtered rows owned by this worker
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ */
+static void cache_store(
+    uint64_t key, const uint8_t *buf, int row_start, int row_end)
+{
+    /* Everyone writes to the temporary file of the first worker. */
+    char path[FILENAME_MAX], tmp_path[FILENAME_MAX + 32];
+    int pid = (int)getpid();
+    MPI_Check(MPI_Bcast(&pid, 1, MPI_INT, 0, MPI_COMM_WORLD));
+    cache_path(path, key);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, pid);
+
+    MPI_File file;
+    int ok = MPI_File_open(MPI_COMM_WORLD, tmp_path,
+                 MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &file)
+        == MPI_SUCCESS;
+    if (ok) {
+        size_t len = (size_t)(row_end - row_start) * BITMAP_STRIDE;
+        ok = MPI_File_write_at_all(file,
+                 (MPI_Offset)row_start * BITMAP_STRIDE, buf, (int)len,
+                 MPI_BYTE, MPI_STATUS_IGNORE)
+            == MPI_SUCCESS;
+        MPI_File_close(&file);
+    }
+
+    MPI_Check(
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD));
+    if (g_rank != 0)
+        return;
+
+    if (!ok) {
+        errf("could not write cache entry `%s'", tmp_path);
+        MPI_File_delete(tmp_path, MPI_INFO_NULL);
+    } else if (rename(tmp_path, path)) {
+        errf("could not write cache entry `%s': %s", path, strerror(errno));
+        remove(tmp_path);
+    }
+}
+
+/* State a worker keeps between passes when it stays around for changes. */
+struct worker_state {
+    struct filter_chain *chain;
+    char *filters; /* the chain points into it, NULL if from argv */
+    uint8_t *raw; /* rows of the input file as read */
+    uint8_t **layer_bufs;
+    const int *layer_bpp;
+    int num_rows, row_start, row_end;
+    size_t num_tiles;
+    uint64_t *src_hashes; /* of every tile of the input */
+    uint64_t *dest_hashes; /* of every tile as last sent */
+};
+
+/* Frees the 3D LUTs and history and tears the warps of a filter chain down.
+ * This is a collective operation.
+ * @chain: Filter chain
+ */
+static void free_filter_state(struct filter_chain *chain)
+{
+    for (size_t i = 0; i < chain->len; i++) {
+        struct filter *f = &chain->stages[i];
+        if (f->lut) {
+            free(f->lut->entries);
+            free(f->lut);
+            f->lut = NULL;
+        }
+        if (f->warp) {
+            free_warp(f->warp);
+            f->warp = NULL;
+        }
+        if (f->history) {
+            free_buffer(f->history->frames);
+            free_buffer(f->history->sums);
+            free(f->history->quot);
+            free(f->history);
+            f->history = NULL;
+        }
+    }
+}
+
+/* Loads the 3D LUTs of a filter chain and sets up the history of its
+ * temporal stages. This is a collective operation.
+ * Returns -1 if a LUT could not be loaded, 0 otherwise
+ * @chain: Filter chain
+ */
+static int load_filter_state(struct filter_chain *chain)
+{
+    for (size_t i = 0; i < chain->len; i++) {
+        struct filter *f = &chain->stages[i];
+        if (f->op == 'u' && !(f->lut = load_lut3d(f))) {
+            free_filter_state(chain);
+            return -1;
+        }
+        if (is_temporal_filter(f))
+            f->history = calloc(1, sizeof(struct history));
+    }
+    return 0;
+}
+
+/* Forgets every frame the temporal stages of a filter chain have seen.
+ * @chain: Filter chain
+ */
+static void reset_filter_history(struct filter_chain *chain)
+{
+    for (size_t i = 0; i < chain->len; i++) {
+        if (chain->stages[i].history)
+            reset_history(chain->stages[i].history);
+    }
+}
+
+/* Hashes a tile.
+ * Returns the hash
+ * @rows: First pixel of the tile
+ * @stride: Distance between rows of the tile in bytes
+ * @w: Width of the tile
+ * @h: Height of the tile
+ */
+static uint64_t hash_tile(const uint8_t *rows, size_t stride, int w, int h)
+{
+    uint64_t hash = 0;
+    for (int y = 0; y < h; y++)
+        hash = xxh64(rows + y * stride, (size_t)w * BITMAP_BPP, hash);
+    return hash;
+}
+
+/* Hashes every tile of the rows owned by this worker.
+ * @buf: Rows owned by this worker
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @hashes: Output hashes, one per tile in row-major order
+ */
+static void hash_tiles(const uint8_t *buf, int row_start, int row_end,
+    uint64_t *hashes)
+{
+    for (int ty = row_start; ty < row_end; ty += TILE_SIZE) {
+        for (int tx = 0; tx < BITMAP_WIDTH; tx += TILE_SIZE) {
+            *hashes++ = hash_tile(buf
+                    + (size_t)(ty - row_start) * BITMAP_STRIDE
+                    + (size_t)tx * BITMAP_BPP,
+                BITMAP_STRIDE, min(TILE_SIZE, BITMAP_WIDTH - tx),
+                min(TILE_SIZE, row_end - ty));
+        }
+    }
+}
+
+/* Sends the tiles of the rows owned by this worker that differ from what
+ * was last sent.
+ * @ws: Worker state
+ * @buf: Filtered rows owned by this worker
+ * @parent_comm: Communicator to the renderer
+ */
+static void send_changed_tiles(struct worker_state *ws, const uint8_t *buf,
+    MPI_Comm parent_comm)
+{
+    size_t t = 0;
+    for (int ty = ws->row_start; ty < ws->row_end; ty += TILE_SIZE) {
+        for (int tx = 0; tx < BITMAP_WIDTH; tx += TILE_SIZE, t++) {
+            int w = min(TILE_SIZE, BITMAP_WIDTH - tx),
+                h = min(TILE_SIZE, ws->row_end - ty);
+            uint64_t hash = hash_tile(buf
+                    + (size_t)(ty - ws->row_start) * BITMAP_STRIDE
+                    + (size_t)tx * BITMAP_BPP,
+                BITMAP_STRIDE, w, h);
+            if (hash != ws->dest_hashes[t]) {
+                ws->dest_hashes[t] = hash;
+                send_tile(buf, ws->row_start, tx, ty, w, h, 0, parent_comm);
+            }
+        }
+    }
+}
+
+/* Re-reads the rows owned by this worker after the input file changed, and
+ * re-filters and re-sends the tiles that changed. This is a collective
+ * operation.
+ * @ws: Worker state
+ * @stats: Statistics to accumulate the rows into, may be NULL
+ * @parent_comm: Communicator to the renderer
+ */
+static void refresh_rows(struct worker_state *ws, struct image_stats *stats,
+    MPI_Comm parent_comm)
+{
+    int num_rows = 0, row_start, row_end;
+    uint8_t *buf
+        = read_rows(g_opts.input_path, stats, &num_rows, &row_start, &row_end);
+    if (num_rows != ws->num_rows) {
+        if (g_rank == 0) {
+            errf("input file has %d rows now, expected %d; ignoring change",
+                num_rows, ws->num_rows);
+        }
+        free_buffer(buf);
+        return;
+    }
+
+    uint64_t *hashes = malloc(ws->num_tiles * sizeof(uint64_t));
+    hash_tiles(buf, row_start, row_end, hashes);
+
+    if (is_point_chain(ws->chain)) {
+        /* Filter the tiles that changed on their own. */
+        size_t t = 0;
+        for (int ty = row_start; ty < row_end; ty += TILE_SIZE) {
+            for (int tx = 0; tx < BITMAP_WIDTH; tx += TILE_SIZE, t++) {
+                if (hashes[t] == ws->src_hashes[t])
+                    continue;
+
+                struct tile_header *tile = get_msg(&g_msg_pool);
+                uint8_t *pixels = (uint8_t *)(tile + 1);
+                tile->x = (uint16_t)tx;
+                tile->y = (uint16_t)ty;
+                tile->w = (uint16_t)min(TILE_SIZE, BITMAP_WIDTH - tx);
+                tile->h = (uint16_t)min(TILE_SIZE, row_end - ty);
+                tile->scale = 0;
+
+                size_t row_len = (size_t)tile->w * BITMAP_BPP;
+                for (int y = 0; y < tile->h; y++) {
+                    size_t off
+                        = (size_t)(ty + y - row_start) * BITMAP_WIDTH + tx;
+                    memcpy(pixels + y * row_len, buf + off * BITMAP_BPP,
+                        row_len);
+
+                    if (g_opts.num_layers) {
+                        uint8_t *layer_spans[MAX_LAYERS];
+                        for (size_t l = 0; l < g_opts.num_layers; l++) {
+                            layer_spans[l] = ws->layer_bufs[l]
+                                + off * ws->layer_bpp[l];
+                        }
+                        composite_layers(pixels + y * row_len, layer_spans,
+                            ws->layer_bpp, tile->w);
+                    }
+                }
+                apply_point_filters(pixels, (size_t)tile->w * tile->h,
+                    ws->chain->stages, ws->chain->len);
+
+                uint64_t hash
+                    = hash_tile(pixels, row_len, tile->w, tile->h);
+                if (hash != ws->dest_hashes[t]) {
+                    ws->dest_hashes[t] = hash;
+                    post_msg(&g_msg_pool, tile,
+                        sizeof(*tile) + tile->h * row_len, parent_comm);
+                } else {
+                    put_msg(&g_msg_pool, tile);
+                }
+            }
+        }
+    } else {
+        /* Warps may read from anywhere in the image, so if anything changed
+         * anywhere refilter everything and send the tiles whose filtered
+         * output changed. */
+        int changed
+            = memcmp(hashes, ws->src_hashes, ws->num_tiles * sizeof(uint64_t))
+            != 0;
+        MPI_Check(MPI_Allreduce(
+            MPI_IN_PLACE, &changed, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD));
+
+        if (changed) {
+            size_t len = (size_t)(row_end - row_start) * BITMAP_STRIDE;
+            uint8_t *out = alloc_buffer(len);
+            memcpy(out, buf, len);
+            process_rows(out, ws->layer_bufs, ws->layer_bpp, ws->chain,
+                row_start, row_end, num_rows);
+            send_changed_tiles(ws, out, parent_comm);
+            free_buffer(out);
+        }
+    }
+
+    memcpy(ws->src_hashes, hashes, ws->num_tiles * sizeof(uint64_t));
+    free(hashes);
+    free_buffer(ws->raw);
+    ws->raw = buf;
+}
+
+/* Re-filters the rows owned by this worker with a new filter chain and
+ * re-sends the tiles that changed. This is a collective operation.
+ * @ws: Worker state
+ * @filters: New filter string, owned by the worker state from now on
+ * @parent_comm: Communicator to the renderer
+ */
+static void refilter_rows(struct worker_state *ws, char *filters,
+    MPI_Comm parent_comm)
+{
+    /* The renderer has validated the filter string already, but LUTs may
+     * have changed since. Keep the current chain if they won't load. */
+    struct filter_chain chain;
+    if (parse_filters(filters, &chain) < 0) {
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+    if (load_filter_state(&chain) < 0) {
+        if (g_rank == 0)
+            errf("could not load filters `%s'; ignoring change", filters);
+        free(filters);
+        return;
+    }
+    free_filter_state(ws->chain);
+    *ws->chain = chain;
+    free(ws->filters);
+    ws->filters = filters;
+
+    size_t len = (size_t)(ws->row_end - ws->row_start) * BITMAP_STRIDE;
+    uint8_t *out = alloc_buffer(len);
+    memcpy(out, ws->raw, len);
+    process_rows(out, ws->layer_bufs, ws->layer_bpp, ws->chain,
+        ws->row_start, ws->row_end, ws->num_rows);
+    send_changed_tiles(ws, out, parent_comm);
+    free_buffer(out);
+}
+
+/* Sends the statistics of the rows owned by this worker to the renderer.
+ * @stats: Statistics
+ * @parent_comm: Communicator to the renderer
+ */
+static void reduce_image_stats(struct image_stats *stats,
+    MPI_Comm parent_comm)
+{
+    MPI_Check(MPI_Reduce(&stats->num_pixels, NULL, IMAGE_STATS_SUMS,
+        MPI_UINT64_T, MPI_SUM, 0, parent_comm));
+    MPI_Check(
+        MPI_Reduce(stats->min, NULL, 3, MPI_INT, MPI_MIN, 0, parent_comm));
+    MPI_Check(
+        MPI_Reduce(stats->max, NULL, 3, MPI_INT, MPI_MAX, 0, parent_comm));
+}
+
+/* Resets image statistics before accumulating rows into them.
+ * @stats: Statistics
+ */
+static void reset_image_stats(struct image_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int c = 0; c < 3; c++)
+        stats->min[c] = 0xff;
+}
+
+/* Starts filtering a slice of rows on the renderer: the last of the
+ * slices rows are split into, right after those of the workers.
+ * @slice: Renderer slice
+ * @num_workers: Number of workers
+ */
+static void open_slice(struct render_slice *slice, int num_workers)
+{
+    if (parse_filters(g_opts.filters, &slice->chain) < 0
+        || !is_point_chain(&slice->chain)) {
+        errf("--share only supports filters that work on single pixels");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+    load_filter_state(&slice->chain);
+
+    /* The workers check the input length already. */
+    MPI_Offset len;
+    MPI_Check(MPI_File_open(MPI_COMM_SELF, g_opts.input_path,
+        MPI_MODE_RDONLY, MPI_INFO_NULL, &slice->file));
+    MPI_Check_close(&slice->file, MPI_File_get_size(slice->file, &len));
+
+    g_num_slices = num_workers + 1;
+    worker_rows(num_workers, (int)(len / BITMAP_STRIDE), &slice->next,
+        &slice->end);
+    slice->band = alloc_buffer((size_t)TILE_SIZE * BITMAP_STRIDE);
+    reset_image_stats(&slice->stats);
+    logf("filtering rows %d-%d while idle", slice->next, slice->end - 1);
+}
+
+/* Reads, filters and draws the next band of TILE_SIZE rows of the
+ * renderer's slice.
+ * Returns the number of pixels drawn
+ * @slice: Renderer slice
+ * @canvas: Canvas to draw onto
+ */
+static size_t filter_slice_band(struct render_slice *slice,
+    struct canvas *canvas)
+{
+    struct tile_header tile = { 0, (uint16_t)slice->next, BITMAP_WIDTH,
+        (uint16_t)min(TILE_SIZE, slice->end - slice->next), 0 };
+    size_t num_pixels = (size_t)tile.h * BITMAP_WIDTH;
+    MPI_Check(MPI_File_read_at(slice->file,
+        (MPI_Offset)slice->next * BITMAP_STRIDE, slice->band,
+        tile.h * BITMAP_STRIDE, MPI_BYTE, MPI_STATUS_IGNORE));
+    if (g_opts.stats) {
+        accumulate_stats(
+            &slice->stats, slice->band, slice->next, slice->next + tile.h);
+    }
+
+    apply_point_filters(
+        slice->band, num_pixels, slice->chain.stages, slice->chain.len);
+    canvas_draw_tile(canvas, &tile, slice->band);
+    slice->next += tile.h;
+    return num_pixels;
+}
+
+/* Frees the resources of a renderer slice.
+ * @slice: Renderer slice
+ */
+static void close_slice(struct render_slice *slice)
+{
+    free_buffer(slice->band);
+    free_filter_state(&slice->chain);
+    MPI_Check(MPI_File_close(&slice->file));
+}
+
+/* Carries out the commands of the renderer until it quits.
+ * @ws: Worker state
+ * @stats: Statistics of the rows owned by this worker
+ * @parent_comm: Communicator to the renderer
+ */
+static void serve_commands(struct worker_state *ws, struct image_stats *stats,
+    MPI_Comm parent_comm)
+{
+    for (;;) {
+        int command, len;
+        MPI_Check(MPI_Bcast(&command, 1, MPI_INT, 0, parent_comm));
+        if (command == CMD_QUIT)
+            break;
+
+        if (command == CMD_FILTERS) {
+            MPI_Check(MPI_Bcast(&len, 1, MPI_INT, 0, parent_comm));
+            char *filters = malloc(len + 1);
+            MPI_Check(MPI_Bcast(filters, len + 1, MPI_CHAR, 0, parent_comm));
+            refilter_rows(ws, filters, parent_comm);
+        } else {
+            reset_image_stats(stats);
+            refresh_rows(ws, g_opts.stats ? stats : NULL, parent_comm);
+        }
+
+        send_done(parent_comm);
+        if (g_opts.stats)
+            reduce_image_stats(stats, parent_comm);
+    }
+}
+
+/* Sequence of frames the input is made of. */
+struct frame_source {
+    const char *pattern; /* numbered file pattern, NULL if concatenated */
+    MPI_File file; /* concatenated frames, if there's no pattern */
+    int num_frames, num_rows, row_start, row_end;
+};
+
+/* Outgoing messages of a frame, sent through persistent requests. */
+struct frame_slot {
+    uint8_t *msgs; /* a tile header and its pixels for every tile */
+    MPI_Request *reqs; /* one per tile and resolution, plus TAG_DONE for
+                          every renderer */
+    int num_tiles, num_reqs;
+};
+
+/* Opens the sequence of frames the input is made of, either numbered files
+ * or frames concatenated into one file. This is a collective operation.
+ * @src: Frame source
+ * @input_path: Path or pattern of the input file
+ */
+static void open_frames(struct frame_source *src, const char *input_path)
+{
+    char path[FILENAME_MAX];
+    MPI_File file;
+    MPI_Offset len;
+
+    src->pattern = strchr(input_path, '%') ? input_path : NULL;
+    src->num_frames = g_opts.num_frames;
+    if (src->pattern) {
+        /* Count the frames up to the first missing one. */
+        int num_frames = 0;
+        if (g_rank == 0) {
+            while (!g_opts.num_frames || num_frames < g_opts.num_frames) {
+                snprintf(path, sizeof(path), input_path, num_frames);
+                if (access(path, R_OK))
+                    break;
+                num_frames++;
+            }
+        }
+        MPI_Check(MPI_Bcast(&num_frames, 1, MPI_INT, 0, MPI_COMM_WORLD));
+        if (!num_frames) {
+            errf("no frames matching `%s'", input_path);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            MPI_Finalize();
+            _exit(EXIT_FAILURE);
+        }
+        src->num_frames = num_frames;
+        snprintf(path, sizeof(path), input_path, 0);
+    } else {
+        snprintf(path, sizeof(path), "%s", input_path);
+    }
+
+    logf("opening file `%s' for reading", path);
+    MPI_Check(MPI_File_open(
+        MPI_COMM_WORLD, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &file));
+    MPI_Check_close(&file, MPI_File_get_size(file, &len));
+
+    MPI_Offset frame_len = len / (src->pattern ? 1 : src->num_frames);
+    if (!frame_len || frame_len % BITMAP_STRIDE
+        || frame_len * (src->pattern ? 1 : src->num_frames) != len) {
+        errf("invalid input length. Expected %d frames of a multiple of %d "
+             "bytes but got %lld bytes.",
+            src->pattern ? 1 : src->num_frames, BITMAP_STRIDE, len);
+        MPI_File_close(&file);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+
+    src->num_rows = (int)(frame_len / BITMAP_STRIDE);
+    worker_rows(g_rank, src->num_rows, &src->row_start, &src->row_end);
+    if (src->pattern) {
+        MPI_Check(MPI_File_close(&file));
+    } else {
+        src->file = file;
+    }
+}
+
+/* Reads the rows owned by this worker of a frame. This is a collective
+ * operation.
+ * @src: Frame source
+ * @frame: Frame number
+ * @buf: Output buffer
+ * @stats: Statistics to accumulate the rows into as read, may be NULL
+ */
+static void read_frame(struct frame_source *src, int frame, uint8_t *buf,
+    struct image_stats *stats)
+{
+    MPI_Offset frame_len = (MPI_Offset)src->num_rows * BITMAP_STRIDE,
+               chunk_len = (MPI_Offset)(src->row_end - src->row_start)
+        * BITMAP_STRIDE,
+               offset = (MPI_Offset)frame * frame_len;
+    MPI_File file = src->file;
+
+    if (src->pattern) {
+        char path[FILENAME_MAX];
+        MPI_Offset len;
+        snprintf(path, sizeof(path), src->pattern, frame);
+        MPI_Check(MPI_File_open(
+            MPI_COMM_WORLD, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &file));
+        MPI_Check_close(&file, MPI_File_get_size(file, &len));
+        if (len != frame_len) {
+            errf("invalid length of frame `%s'. Expected %lld bytes but got "
+                 "%lld.",
+                path, frame_len, len);
+            MPI_File_close(&file);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            MPI_Finalize();
+            _exit(EXIT_FAILURE);
+        }
+        offset = 0;
+    }
+
+    MPI_Check(MPI_File_read_at_all(file,
+        offset + (MPI_Offset)src->row_start * BITMAP_STRIDE, buf,
+        (int)chunk_len, MPI_BYTE, MPI_STATUS_IGNORE));
+    if (src->pattern)
+        MPI_Check(MPI_File_close(&file));
+
+    if (stats)
+        accumulate_stats(stats, buf, src->row_start, src->row_end);
+}
+
+/* Sets up the persistent requests sending every tile of a frame to the
+ * renderer showing it, at every resolution, followed by TAG_DONE to every
+ * renderer. Only the tiles that need to be sent get started, at a single
+ * resolution.
+ * @slot: Frame slot
+ * @row_start: First row owned by this worker
+ * @row_end: One past the last row owned by this worker
+ * @parent_comm: Communicator to the renderer
+ */
+static void init_frame_slot(struct frame_slot *slot, int row_start,
+    int row_end, MPI_Comm parent_comm)
+{
+    size_t msg_len = sizeof(struct tile_header) + TILE_BYTES;
+    slot->num_tiles = (BITMAP_WIDTH + TILE_SIZE - 1) / TILE_SIZE
+        * ((row_end - row_start + TILE_SIZE - 1) / TILE_SIZE);
+    MPI_Check(MPI_Alloc_mem((MPI_Aint)(slot->num_tiles * msg_len),
+        MPI_INFO_NULL, &slot->msgs));
+    slot->num_reqs = slot->num_tiles * QUALITY_SCALES + g_num_renderers;
+    slot->reqs = malloc(slot->num_reqs * sizeof(MPI_Request));
+    g_num_allocs += 2;
+
+    /* All resolutions of a tile share the same message buffer, as only one
+     * of them may be active at a time. */
+    int t = 0;
+    for (int ty = row_start; ty < row_end; ty += TILE_SIZE) {
+        for (int tx = 0; tx < BITMAP_WIDTH; tx += TILE_SIZE, t++) {
+            struct tile_header *tile
+                = (struct tile_header *)(slot->msgs + t * msg_len);
+            tile->x = (uint16_t)tx;
+            tile->y = (uint16_t)ty;
+            tile->w = (uint16_t)min(TILE_SIZE, BITMAP_WIDTH - tx);
+            tile->h = (uint16_t)min(TILE_SIZE, row_end - ty);
+            tile->scale = 0;
+
+            for (int s = 0; s < QUALITY_SCALES; s++) {
+                size_t w = (tile->w + (1 << s) - 1) >> s,
+                       h = (tile->h + (1 << s) - 1) >> s;
+                MPI_Check(MPI_Send_init(tile,
+                    (int)(sizeof(*tile) + w * h * BITMAP_BPP), MPI_BYTE,
+                    row_renderer(ty), TAG_TILE, parent_comm,
+                    &slot->reqs[s * slot->num_tiles + t]));
+            }
+        }
+    }
+    for (int r = 0; r < g_num_renderers; r++) {
+        MPI_Check(MPI_Send_init(NULL, 0, MPI_BYTE, r, TAG_DONE, parent_comm,
+            &slot->reqs[slot->num_tiles * QUALITY_SCALES + r]));
+    }
+}
+
+/* Sends the tiles of a frame that changed since the previous one, or that
+ * were last sent at a lower resolution than the current one.
+ * @slot: Frame slot, whose requests must be inactive
+ * @buf: Filtered rows owned by this worker
+ * @prev: Filtered rows of the previous frame, NULL if there's none
+ * @row_start: First row owned by this worker
+ * @scale: Resolution to send tiles at, as a power of two to divide by
+ * @sent_scales: Resolution every tile was last sent at
+ */
+static void send_frame_slot(struct frame_slot *slot, const uint8_t *buf,
+    const uint8_t *prev, int row_start, int scale, uint8_t *sent_scales)
+{
+    size_t msg_len = sizeof(struct tile_header) + TILE_BYTES;
+    for (int t = 0; t < slot->num_tiles; t++) {
+        struct tile_header *tile
+            = (struct tile_header *)(slot->msgs + t * msg_len);
+        size_t off = (size_t)(tile->y - row_start) * BITMAP_STRIDE
+            + (size_t)tile->x * BITMAP_BPP;
+        if (prev && sent_scales[t] <= scale
+            && spans_equal(buf + off, prev + off, BITMAP_STRIDE,
+                (size_t)tile->w * BITMAP_BPP, tile->h))
+            continue;
+
+        tile->scale = (uint16_t)scale;
+        pack_tile(tile, buf + off, BITMAP_STRIDE);
+        sent_scales[t] = (uint8_t)scale;
+        MPI_Check(MPI_Start(&slot->reqs[scale * slot->num_tiles + t]));
+    }
+
+    int num_done = slot->num_reqs - slot->num_tiles * QUALITY_SCALES;
+    MPI_Check(
+        MPI_Startall(num_done, &slot->reqs[slot->num_tiles * QUALITY_SCALES]));
+}
+
+/* Reads, filters and sends every frame of the input. Frames are double
+ * buffered, so that the next frame gets filtered while the renderer is
+ * still receiving the current one, and only the tiles that changed since
+ * the previous frame are sent. Quality is lowered as told by the renderer
+ * whenever it falls behind.
+ * @input_path: Path or pattern of the input file
+ * @chain: Filter chain
+ * @parent_comm: Communicator to the renderer
+ */
+static void stream_frames(const char *input_path,
+    struct filter_chain *chain, MPI_Comm parent_comm)
+{
+    struct frame_source src;
+    open_frames(&src, input_path);
+
+    /* Let the renderer know how many frames to expect. */
+    MPI_Check(MPI_Bcast(&src.num_frames, 1, MPI_INT,
+        g_rank == 0 ? MPI_ROOT : MPI_PROC_NULL, parent_comm));
+
+    uint8_t *layer_bufs[MAX_LAYERS];
+    int layer_bpp[MAX_LAYERS];
+    read_layers(layer_bufs, layer_bpp, src.row_start, src.row_end,
+        src.num_rows);
+
+    struct frame_slot slots[2];
+    for (int s = 0; s < 2; s++)
+        init_frame_slot(&slots[s], src.row_start, src.row_end, parent_comm);
+    uint8_t *sent_scales = calloc(slots[0].num_tiles, 1);
+
+    /* The same chain minus its most expensive stages, for when we're
+     * falling behind. Temporal stages share their history with it. */
+    struct filter_chain cheap_chain = { 0 };
+    for (size_t i = 0; i < chain->len; i++) {
+        char op = chain->stages[i].op;
+        if (op != 'w' && op != 'k' && op != 'u')
+            cheap_chain.stages[cheap_chain.len++] = chain->stages[i];
+    }
+
+    struct image_stats stats;
+    size_t len = (size_t)(src.row_end - src.row_start) * BITMAP_STRIDE;
+    uint8_t *buf = alloc_buffer(len), *prev = alloc_buffer(len);
+    first_touch(buf, src.row_end - src.row_start);
+    first_touch(prev, src.row_end - src.row_start);
+    int quality = QUALITY_FULL, num_updates = 0;
+    unsigned long long num_allocs = g_num_allocs;
+    for (int frame = 0; frame < src.num_frames; frame++) {
+        /* Pick up the latest quality level, and agree on it as warps are
+         * collective. */
+        int pending, level;
+        MPI_Check(MPI_Iprobe(
+            0, TAG_QUALITY, parent_comm, &pending, MPI_STATUS_IGNORE));
+        while (pending) {
+            MPI_Check(MPI_Recv(&quality, 1, MPI_INT, 0, TAG_QUALITY,
+                parent_comm, MPI_STATUS_IGNORE));
+            num_updates++;
+            MPI_Check(MPI_Iprobe(
+                0, TAG_QUALITY, parent_comm, &pending, MPI_STATUS_IGNORE));
+        }
+        level = quality;
+        MPI_Check(MPI_Allreduce(
+            MPI_IN_PLACE, &level, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD));
+
+        reset_image_stats(&stats);
+        read_frame(&src, frame, buf, g_opts.stats ? &stats : NULL);
+        process_rows(buf, layer_bufs, layer_bpp,
+            level >= QUALITY_CHEAP ? &cheap_chain : chain, src.row_start,
+            src.row_end, src.num_rows);
+
+        /* Wait for the frame before last to be out before reusing its
+         * messages. */
+        struct frame_slot *slot = &slots[frame % 2];
+        MPI_Check(
+            MPI_Waitall(slot->num_reqs, slot->reqs, MPI_STATUSES_IGNORE));
+        send_frame_slot(slot, buf, frame ? prev : NULL, src.row_start,
+            level >= QUALITY_HALF ? level - QUALITY_HALF + 1 : 0,
+            sent_scales);
+
+        uint8_t *tmp = prev;
+        prev = buf;
+        buf = tmp;
+
+        if (g_opts.stats)
+            reduce_image_stats(&stats, parent_comm);
+        if (!frame)
+            num_allocs = g_num_allocs;
+    }
+
+    /* Take the quality updates still in flight. */
+    int num_sent;
+    MPI_Check(MPI_Bcast(&num_sent, 1, MPI_INT, 0, parent_comm));
+    for (; num_updates < num_sent; num_updates++) {
+        MPI_Check(MPI_Recv(&quality, 1, MPI_INT, 0, TAG_QUALITY, parent_comm,
+            MPI_STATUS_IGNORE));
+    }
+    num_allocs = g_num_allocs - num_allocs;
+    MPI_Check(MPI_Reduce(&num_allocs, NULL, 1, MPI_UNSIGNED_LONG_LONG,
+        MPI_SUM, 0, parent_comm));
+
+    free_buffer(buf);
+    free_buffer(prev);
+    free(sent_scales);
+    for (int s = 0; s < 2; s++) {
+        MPI_Check(MPI_Waitall(
+            slots[s].num_reqs, slots[s].reqs, MPI_STATUSES_IGNORE));
+        for (int i = 0; i < slots[s].num_reqs; i++)
+            MPI_Check(MPI_Request_free(&slots[s].reqs[i]));
+        free(slots[s].reqs);
+        MPI_Check(MPI_Free_mem(slots[s].msgs));
+    }
+
+    for (size_t l = 0; l < g_opts.num_layers; l++)
+        free_buffer(layer_bufs[l]);
+    if (!src.pattern)
+        MPI_Check(MPI_File_close(&src.file));
+}
+
+/* Serves the bands of rows the renderer asks for in browse mode until it
+ * quits. Only the rows in sight get read and filtered, on demand.
+ * @input_path: Path to the input file
+ * @chain: Filter chain, made of point filters only
+ * @parent_comm: Communicator to the renderer
+ */
+static void serve_views(const char *input_path,
+    const struct filter_chain *chain, MPI_Comm parent_comm)
+{
+    if (!is_point_chain(chain)) {
+        errf("--browse only supports filters that work on single pixels");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+
+    MPI_File file;
+    MPI_Offset len;
+    logf("opening file `%s' for reading", input_path);
+    MPI_Check(MPI_File_open(
+        MPI_COMM_WORLD, input_path, MPI_MODE_RDONLY, MPI_INFO_NULL, &file));
+    MPI_Check_close(&file, MPI_File_get_size(file, &len));
+    if (!len || len % BITMAP_STRIDE || len / BITMAP_STRIDE > UINT16_MAX) {
+        errf("invalid input length. Expected a multiple of %d of up to %d "
+             "rows but got %lld bytes.",
+            BITMAP_STRIDE, UINT16_MAX, len);
+        MPI_File_close(&file);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+
+    /* Make offsets relative to our own rows. */
+    int num_rows = (int)(len / BITMAP_STRIDE), row_start, row_end;
+    worker_rows(g_rank, num_rows, &row_start, &row_end);
+    MPI_Check_close(&file,
+        MPI_File_set_view(file, (MPI_Offset)row_start * BITMAP_STRIDE,
+            MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL));
+    MPI_Check(MPI_Bcast(&num_rows, 1, MPI_INT,
+        g_rank == 0 ? MPI_ROOT : MPI_PROC_NULL, parent_comm));
+
+    int bands[VIEW_CACHE_BANDS];
+    for (;;) {
+        int command, num_bands;
+        MPI_Check(MPI_Bcast(&command, 1, MPI_INT, 0, parent_comm));
+        if (command == CMD_QUIT)
+            break;
+
+        MPI_Check(MPI_Bcast(&num_bands, 1, MPI_INT, 0, parent_comm));
+        MPI_Check(MPI_Bcast(bands, num_bands, MPI_INT, 0, parent_comm));
+        for (int i = 0; i < num_bands; i++) {
+            int y = bands[i] * TILE_SIZE;
+            if (y < row_start || y >= row_end)
+                continue;
+
+            struct tile_header *tile = get_msg(&g_msg_pool);
+            uint8_t *pixels = (uint8_t *)(tile + 1);
+            tile->x = 0;
+            tile->y = (uint16_t)y;
+            tile->w = BITMAP_WIDTH;
+            tile->h = (uint16_t)min(TILE_SIZE, row_end - y);
+            tile->scale = 0;
+            MPI_Check(MPI_File_read_at(file,
+                (MPI_Offset)(y - row_start) * BITMAP_STRIDE, pixels,
+                tile->h * BITMAP_STRIDE, MPI_BYTE, MPI_STATUS_IGNORE));
+            apply_point_filters(pixels, (size_t)tile->h * BITMAP_WIDTH,
+                chain->stages, chain->len);
+            post_msg(&g_msg_pool, tile,
+                sizeof(*tile) + (size_t)tile->h * BITMAP_STRIDE, parent_comm);
+        }
+        send_done(parent_comm);
+    }
+
+    MPI_Check(MPI_File_close(&file));
+}
+
+/* Bands of TILE_SIZE rows workers read, filter and send at a time. */
+static int g_block_bands = 1;
+
+/* Sizes the blocks workers stream their rows in so that a block fills half
+ * the L2 cache, leaving the rest to the filters' own data. Blocks take up
+ * no more than half the message pool, so that one can be read and filtered
+ * while the last one is still being sent.
+ */
+static void tune_block_size(void)
+{
+    long l2_size = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    l2_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (l2_size <= 0)
+        l2_size = DEFAULT_L2_SIZE;
+
+    g_block_bands = (int)(l2_size / 2 / ((long)TILE_SIZE * BITMAP_STRIDE));
+    if (g_block_bands < 1)
+        g_block_bands = 1;
+    g_block_bands = min(g_block_bands, TILE_POOL_SIZE / 2);
+}
+
+/* Tile messages filtered in place, one message per task. */
+struct msg_job {
+    struct tile_header **msgs;
+    const struct filter_chain *chain;
+};
+
+/* Runs the pixels of a tile message through a chain of point filters.
+ * @arg: Message job
+ * @i: Message index
+ */
+static void filter_msg(void *arg, int i)
+{
+    const struct msg_job *job = arg;
+    struct tile_header *tile = job->msgs[i];
+    apply_point_filters((uint8_t *)(tile + 1), (size_t)tile->w * tile->h,
+        job->chain->stages, job->chain->len);
+}
+
+/* Reads, filters and sends the rows owned by this worker a block at a time,
+ * so that every block is still in cache while it's filtered and sent. Rows
+ * are read straight into tile messages of the pool and filtered in place
+ * there, so they're never copied. This is a collective operation.
+ * @path: Path to the file containing the data
+ * @chain: Filter chain, made of point filters only
+ * @stats: Statistics to accumulate the rows into as read, may be NULL
+ * @parent_comm: Communicator to the renderer
+ */
+static void send_blocks(const char *path, const struct filter_chain *chain,
+    struct image_stats *stats, MPI_Comm parent_comm)
+{
+    MPI_File file;
+    int num_rows = 0, row_start, row_end;
+    open_rows(path, &file, &num_rows, &row_start, &row_end);
+
+    struct tile_header *msgs[TILE_POOL_SIZE];
+    struct msg_job job = { msgs, chain };
+    int block_rows = g_block_bands * TILE_SIZE;
+    for (int y = row_start; y < row_end; y += block_rows) {
+        int n = 0;
+        for (int ty = y; ty < min(y + block_rows, row_end); ty += TILE_SIZE) {
+            struct tile_header *tile = msgs[n++] = get_msg(&g_msg_pool);
+            tile->x = 0;
+            tile->y = (uint16_t)ty;
+            tile->w = BITMAP_WIDTH;
+            tile->h = (uint16_t)min(TILE_SIZE, row_end - ty);
+            tile->scale = 0;
+            MPI_Check(MPI_File_read_at(file, (MPI_Offset)ty * BITMAP_STRIDE,
+                tile + 1, tile->h * BITMAP_STRIDE, MPI_BYTE,
+                MPI_STATUS_IGNORE));
+            if (stats) {
+                accumulate_stats(
+                    stats, (uint8_t *)(tile + 1), ty, ty + tile->h);
+            }
+        }
+
+        pool_run(g_pool, n, filter_msg, &job);
+        for (int i = 0; i < n; i++) {
+            post_msg(&g_msg_pool, msgs[i],
+                sizeof(*msgs[i]) + (size_t)msgs[i]->h * BITMAP_STRIDE,
+                parent_comm);
+        }
+    }
+
+    MPI_Check(MPI_File_close(&file));
+}
+
+/* Reads raw RGB data from the supplied input file and sends them out so the
+ * renderer process can blit those pixels. If asked to, keeps around to
+ * re-send whatever changes until the renderer quits.
+ * @input_path: Path to the file containing the data, or pattern of the
+ * files containing every frame
+ * @filters: Filter string
+ */
+static void read_data(const char *input_path, const char *filters)
+{
+    /* Compile filter chain. */
+    struct filter_chain chain;
+    if (parse_filters(filters, &chain) < 0
+        || load_filter_state(&chain) < 0) {
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+
+    MPI_Comm parent_comm;
+    MPI_Comm_get_parent(&parent_comm);
+    MPI_Check(MPI_Comm_remote_size(parent_comm, &g_num_renderers));
+    g_num_slices = g_size + g_opts.share;
+    if (g_opts.share && !is_point_chain(&chain)) {
+        errf("--share only supports filters that work on single pixels");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        MPI_Finalize();
+        _exit(EXIT_FAILURE);
+    }
+    if (g_opts.sequence) {
+        stream_frames(input_path, &chain, parent_comm);
+        free_filter_state(&chain);
+        return;
+    }
+    if (g_opts.browse) {
+        serve_views(input_path, &chain, parent_comm);
+        free_filter_state(&chain);
+        return;
+    }
+
+    struct image_stats stats;
+    reset_image_stats(&stats);
+
+    /* Plain runs of point filters go through the fused block loop. */
+    if (!g_opts.diff_path && !g_opts.cache_dir && !g_opts.keep_alive
+        && !g_opts.zoom && !g_opts.progressive && !g_opts.num_layers
+        && is_point_chain(&chain)) {
+        send_blocks(input_path, &chain, g_opts.stats ? &stats : NULL,
+            parent_comm);
+        send_done(parent_comm);
+        if (g_opts.stats)
+            reduce_image_stats(&stats, parent_comm);
+        free_filter_state(&chain);
+        return;
+    }
+
+    int num_rows = 0, row_start, row_end;
+    uint8_t *buf = read_rows(input_path, g_opts.stats ? &stats : NULL,
+        &num_rows, &row_start, &row_end);
+    uint8_t *layer_bufs[MAX_LAYERS];
+    int layer_bpp[MAX_LAYERS];
+    read_layers(layer_bufs, layer_bpp, row_start, row_end, num_rows);
+
+    /* Keep the raw rows and track what we've sent if we'll be re-sending
+     * changes. */
+    struct worker_state ws = { &chain, NULL, NULL, layer_bufs, layer_bpp,
+        num_rows, row_start, row_end, 0, NULL, NULL };
+    if (g_opts.keep_alive) {
+        size_t len = (size_t)(row_end - row_start) * BITMAP_STRIDE;
+        ws.raw = alloc_buffer(len);
+        memcpy(ws.raw, buf, len);
+
+        ws.num_tiles = (size_t)(BITMAP_WIDTH + TILE_SIZE - 1) / TILE_SIZE
+            * ((row_end - row_start + TILE_SIZE - 1) / TILE_SIZE);
+        ws.src_hashes = malloc(ws.num_tiles * sizeof(uint64_t));
+        ws.dest_hashes = malloc(ws.num_tiles * sizeof(uint64_t));
+        hash_tiles(buf, row_start, row_end, ws.src_hashes);
+    }
+
+    /* Send data to renderer process. */
+    if (g_opts.diff_path) {
+        /* The reference image goes through the same layers. */
+        uint8_t *ref = read_rows(
+            g_opts.diff_path, NULL, &num_rows, &row_start, &row_end);
+        process_rows(buf, layer_bufs, layer_bpp, &chain, row_start, row_end,
+            num_rows);
+        reset_filter_history(&chain);
+        process_rows(ref, layer_bufs, layer_bpp, &chain, row_start, row_end,
+            num_rows);
+        send_diff(buf, ref, row_start, row_end, parent_comm);
+        free_buffer(ref);
+    } else {
+        /* Look our rows up in the result cache. It's either a hit for
+         * everyone or for no one, as filtering may be collective. */
+        uint64_t key = 0;
+        uint8_t *cached = NULL;
+        if (g_opts.cache_dir) {
+            key = cache_key(buf, layer_bufs, layer_bpp, &chain, row_start,
+                row_end, num_rows);
+            cached = cache_lookup(key, row_start, row_end, num_rows);
+            logf("cache %s for key %016llx", cached ? "hit" : "miss",
+                (unsigned long long)key);
+        }
+
+        if (cached) {
+            free_buffer(buf);
+            buf = cached;
+        } else {
+            process_rows(buf, layer_bufs, layer_bpp, &chain, row_start,
+                row_end, num_rows);
+            if (g_opts.cache_dir)
+                cache_store(key, buf, row_start, row_end);
+        }
+
+        if (g_opts.zoom)
+            send_zoomed(buf, row_start, row_end, parent_comm);
+        else if (g_opts.progressive)
+            send_progressive(buf, row_start, row_end, parent_comm);
+        else
+            send_tiles(buf, row_start, row_end, parent_comm);
+
+        send_done(parent_comm);
+    }
+
+    if (g_opts.stats)
+        reduce_image_stats(&stats, parent_comm);
+
+    if (g_opts.keep_alive) {
+        hash_tiles(buf, row_start, row_end, ws.dest_hashes);
+        serve_commands(&ws, &stats, parent_comm);
+
+        free(ws.filters);
+        free_buffer(ws.raw);
+        free(ws.src_hashes);
+        free(ws.dest_hashes);
+    }
+
+    for (size_t l = 0; l < g_opts.num_layers; l++)
+        free_buffer(layer_bufs[l]);
+
+    free_filter_state(&chain);
+    free_buffer(buf);
+}
+
+/* Parse the number of workers from the command line arguments.
+ * Returns -1 on failure, parsed value on success
+ * @str: String to be parsed
+ */
+static int parse_num_workers(char *str)
+{
+    errno = 0;
+    char *endptr;
+    long result = strtol(str, &endptr, 10);
+
+    if (endptr == str)
+        return -1; /* nothing parsed */
+
+    if ((result == INT_MAX || result == INT_MIN) && errno == ERANGE)
+        return -1; /* out of range */
+    return (int)result;
+}
+
+/* Parses a layer specification of the form `MODE:PATH[@OPACITY]'.
+ * Returns -1 on failure, 0 on success
+ * @spec: Layer specification
+ * @layer: Layer to be filled in
+ */
+static int parse_layer(char *spec, struct layer *layer)
+{
+    static const char *mode_names[] = { "over", "multiply", "screen",
+        "difference" };
+
+    char *path = strchr(spec, ':');
+    if (!path)
+        return -1;
+
+    size_t mode_len = path - spec;
+    layer->path = ++path;
+    layer->opacity = 1.0;
+    layer->mode = (enum blend_mode)-1;
+    for (size_t i = 0; i < sizeof(mode_names) / sizeof(*mode_names); i++) {
+        if (strlen(mode_names[i]) == mode_len
+            && !strncmp(spec, mode_names[i], mode_len))
+            layer->mode = (enum blend_mode)i;
+    }
+    if (layer->mode == (enum blend_mode)-1)
+        return -1;
+
+    char *at = strrchr(path, '@'), *endptr;
+    if (at) {
+        double opacity = strtod(at + 1, &endptr);
+        if (endptr != at + 1 && !*endptr) {
+            if (opacity < 0.0 || opacity > 1.0)
+                return -1;
+            layer->opacity = opacity;
+            *at = '\0';
+        }
+    }
+
+    return *layer->path ? 0 : -1;
+}
+
+/* Parses a list of CPUs of the form `0,2,4-7' into the options.
+ * Returns -1 on failure, 0 on success
+ * @str: CPU list
+ */
+static int parse_cpu_list(const char *str)
+{
+    g_opts.num_cpus = 0;
+    for (;;) {
+        char *endptr;
+        long first = strtol(str, &endptr, 10), last = first;
+        if (endptr == str || first < 0 || first >= MAX_CPUS)
+            return -1;
+        if (*endptr == '-') {
+            str = endptr + 1;
+            last = strtol(str, &endptr, 10);
+            if (endptr == str || last < first || last >= MAX_CPUS)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (g_opts.num_cpus == MAX_CPUS)
+                return -1;
+            g_opts.cpus[g_opts.num_cpus++] = (int)cpu;
+        }
+
+        if (!*endptr)
+            return 0;
+        if (*endptr != ',')
+            return -1;
+        str = endptr + 1;
+    }
+}
+
+/* Checks that a frame pattern holds a single %d conversion, optionally with
+ * a zero-padded width, and nothing else printf() would interpret.
+ * Returns 1 if it does, 0 otherwise
+ * @path: Frame pattern
+ */
+static int is_frame_pattern(const char *path)
+{
+    const char *conv = strchr(path, '%');
+    if (!conv)
+        return 0;
+
+    const char *end = conv + 1;
+    while (*end >= '0' && *end <= '9')
+        end++;
+    return *end == 'd' && !strchr(end, '%');
+}
+
+/* Parses the command line into g_opts. Options start with `--' and may
+ * appear anywhere; everything else is a positional argument.
+ * Returns -1 on failure, the number of positional arguments on success
+ * @argc: Number of arguments
+ * @argv: Arguments passed to the program
+ */
+static int parse_options(int argc, char **argv)
+{
+    int num_positional = 0;
+    g_opts.num_threads = 1;
+
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+
+        if (strncmp(arg, "--", 2)) {
+            switch (num_positional++) {
+            case 0:
+                g_opts.num_workers = arg;
+                break;
+            case 1:
+                g_opts.input_path = arg;
+                break;
+            case 2:
+                g_opts.filters = arg;
+                break;
+            default:
+                fprintf(stderr, PROGNAME ": unexpected argument `%s'\n", arg);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--frames=", 9)) {
+            char *endptr;
+            long num_frames = strtol(arg + 9, &endptr, 10);
+            if (endptr == arg + 9 || *endptr || num_frames < 1
+                || num_frames > INT_MAX) {
+                fprintf(stderr, PROGNAME ": invalid number of frames `%s'\n",
+                    arg + 9);
+                return -1;
+            }
+            g_opts.num_frames = (int)num_frames;
+        } else if (!strncmp(arg, "--fps=", 6)) {
+            char *endptr;
+            g_opts.fps = strtod(arg + 6, &endptr);
+            if (endptr == arg + 6 || *endptr || !(g_opts.fps > 0.0)) {
+                fprintf(stderr, PROGNAME ": invalid frame rate `%s'\n",
+                    arg + 6);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--zoom=", 7)) {
+            char *endptr;
+            long zoom = strtol(arg + 7, &endptr, 10);
+            if (endptr == arg + 7 || *endptr || zoom < 0 || zoom > ZOOM_MAX) {
+                fprintf(stderr,
+                    PROGNAME ": invalid zoom level `%s', expected 0-%d\n",
+                    arg + 7, ZOOM_MAX);
+                return -1;
+            }
+            g_opts.zoom = (int)zoom;
+        } else if (!strcmp(arg, "--share")) {
+            g_opts.share = 1;
+        } else if (!strncmp(arg, "--threads=", 10)) {
+            char *endptr;
+            long num_threads = strtol(arg + 10, &endptr, 10);
+            if (endptr == arg + 10 || *endptr || num_threads < 1
+                || num_threads > MAX_THREADS) {
+                fprintf(stderr,
+                    PROGNAME ": invalid number of threads `%s', expected "
+                             "1-%d\n",
+                    arg + 10, MAX_THREADS);
+                return -1;
+            }
+            g_opts.num_threads = (int)num_threads;
+        } else if (!strncmp(arg, "--affinity=", 11)) {
+            if (!strcmp(arg + 11, "compact")) {
+                g_opts.affinity = AFFINITY_COMPACT;
+            } else if (!strcmp(arg + 11, "scatter")) {
+                g_opts.affinity = AFFINITY_SCATTER;
+            } else if (parse_cpu_list(arg + 11) < 0) {
+                fprintf(stderr, PROGNAME ": invalid affinity `%s'\n",
+                    arg + 11);
+                return -1;
+            } else {
+                g_opts.affinity = AFFINITY_LIST;
+            }
+        } else if (!strncmp(arg, "--layout=", 9)) {
+            if (!strcmp(arg + 9, "rows")) {
+                g_opts.layout = LAYOUT_ROWS;
+            } else if (!strcmp(arg + 9, "morton")) {
+                g_opts.layout = LAYOUT_MORTON;
+            } else {
+                fprintf(stderr, PROGNAME ": invalid layout `%s'\n", arg + 9);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--spawn")) {
+            g_opts.spawn = 1;
+        } else if (!strcmp(arg, "--headless")) {
+            g_opts.headless = 1;
+        } else if (!strcmp(arg, "--browse")) {
+            g_opts.browse = 1;
+        } else if (!strcmp(arg, "--progressive")) {
+            g_opts.progressive = 1;
+        } else if (!strcmp(arg, "--watch")) {
+            g_opts.watch = 1;
+        } else if (!strncmp(arg, "--control=", 10)) {
+            g_opts.control_path = arg + 10;
+        } else if (!strncmp(arg, "--bind=", 7)) {
+            if (g_opts.num_bindings == MAX_BINDINGS) {
+                fprintf(stderr, PROGNAME ": too many key bindings (max. %d)\n",
+                    MAX_BINDINGS);
+                return -1;
+            }
+            if (arg[7] < ' ' || arg[7] > '~' || arg[8] != ':') {
+                fprintf(stderr, PROGNAME ": invalid key binding `%s'\n",
+                    arg + 7);
+                return -1;
+            }
+
+            struct binding *binding = &g_opts.bindings[g_opts.num_bindings++];
+            binding->key = arg[7];
+            binding->filters = arg + 9;
+        } else if (!strncmp(arg, "--cache=", 8)) {
+            g_opts.cache_dir = arg + 8;
+        } else if (!strcmp(arg, "--stats")) {
+            g_opts.stats = 1;
+        } else if (!strncmp(arg, "--stats=", 8)) {
+            g_opts.stats = 1;
+            g_opts.stats_path = arg + 8;
+        } else if (!strncmp(arg, "--diff=", 7)) {
+            g_opts.diff_path = arg + 7;
+        } else if (!strncmp(arg, "--diff-threshold=", 17)) {
+            char *endptr;
+            long threshold = strtol(arg + 17, &endptr, 10);
+            if (endptr == arg + 17 || *endptr || threshold < 0
+                || threshold > 255) {
+                fprintf(stderr, PROGNAME ": invalid diff threshold `%s'\n",
+                    arg + 17);
+                return -1;
+            }
+            g_opts.diff_threshold = (int)threshold;
+        } else if (!strncmp(arg, "--layer=", 8)) {
+            if (g_opts.num_layers == MAX_LAYERS) {
+                fprintf(stderr, PROGNAME ": too many layers (max. %d)\n",
+                    MAX_LAYERS);
+                return -1;
+            }
+
+            /* parse_layer() modifies the argument, keep it intact for the
+             * workers. */
+            char *spec = malloc(strlen(arg + 8) + 1);
+            strcpy(spec, arg + 8);
+            if (parse_layer(spec, &g_opts.layers[g_opts.num_layers++]) < 0) {
+                fprintf(stderr, PROGNAME ": invalid layer `%s'\n", arg + 8);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, PROGNAME ": unknown option `%s'\n", arg);
+            return -1;
+        }
+    }
+
+    if (g_opts.browse
+        && (g_opts.watch || g_opts.control_path || g_opts.num_bindings
+            || g_opts.num_layers || g_opts.diff_path || g_opts.stats
+            || g_opts.cache_dir || g_opts.num_frames || g_opts.zoom
+            || g_opts.progressive
+            || (g_opts.input_path && strchr(g_opts.input_path, '%')))) {
+        fprintf(stderr,
+            PROGNAME ": --browse can't be combined with other options or "
+                     "frame sequences\n");
+        return -1;
+    }
+    g_opts.keep_alive = g_opts.watch || g_opts.control_path
+        || g_opts.num_bindings || g_opts.browse;
+    if (g_opts.input_path && strchr(g_opts.input_path, '%')) {
+        if (!is_frame_pattern(g_opts.input_path)) {
+            fprintf(stderr,
+                PROGNAME ": invalid frame pattern `%s', expected a single "
+                         "%%d\n",
+                g_opts.input_path);
+            return -1;
+        }
+        g_opts.sequence = 1;
+    }
+    g_opts.sequence |= g_opts.num_frames > 0;
+    if (g_opts.sequence
+        && (g_opts.keep_alive || g_opts.diff_path || g_opts.cache_dir)) {
+        fprintf(stderr,
+            PROGNAME ": frame sequences can't be combined with --diff, "
+                     "--cache, --watch, --control or --bind\n");
+        return -1;
+    }
+#ifdef _WIN32
+    if (g_opts.keep_alive) {
+        fprintf(stderr,
+            PROGNAME ": --watch, --control, --bind and --browse are not "
+                     "supported on Windows\n");
+        return -1;
+    }
+    if (g_opts.headless) {
+        fprintf(stderr, PROGNAME ": --headless is not supported on Windows\n");
+        return -1;
+    }
+    if (g_opts.affinity) {
+        fprintf(stderr, PROGNAME ": --affinity is not supported on Windows\n");
+        return -1;
+    }
+#endif
+    if (g_opts.share
+        && (g_opts.keep_alive || g_opts.sequence || g_opts.diff_path
+            || g_opts.cache_dir || g_opts.num_layers || g_opts.zoom
+            || g_opts.progressive)) {
+        fprintf(stderr,
+            PROGNAME ": --share can't be combined with --layer, --diff, "
+                     "--cache, --zoom, --progressive, the keep-alive modes "
+                     "or frame sequences\n");
+        return -1;
+    }
+    if (g_opts.headless && g_opts.keep_alive) {
+        fprintf(stderr,
+            PROGNAME ": --headless can't be combined with --watch, --control, "
+                     "--bind or --browse\n");
+        return -1;
+    }
+    if (g_opts.progressive && (g_opts.sequence || g_opts.diff_path)) {
+        fprintf(stderr,
+            PROGNAME ": --progressive can't be combined with --diff or frame "
+                     "sequences\n");
+        return -1;
+    }
+    if (g_opts.zoom
+        && (g_opts.sequence || g_opts.diff_path || g_opts.keep_alive
+            || g_opts.progressive)) {
+        fprintf(stderr,
+            PROGNAME ": --zoom can't be combined with --diff, --watch, "
+                     "--control, --bind, --progressive or frame sequences\n");
+        return -1;
+    }
+    if (g_opts.keep_alive && g_opts.diff_path) {
+        fprintf(stderr,
+            PROGNAME ": --diff can't be combined with --watch, --control or "
+                     "--bind\n");
+        return -1;
+    }
+
+    return num_positional;
+}
+
+#ifndef _WIN32
+/* Rows filtered by one of the renderer's threads in in-process mode. */
+struct inproc_thread {
+    pthread_t thread;
+    int index;
+    const struct filter_chain *chain;
+    struct canvas *canvas;
+    int row_start, row_end;
+    int failed;
+};
+
+/* Reads and filters the rows of a thread band by band, drawing them to the
+ * framebuffer. Threads own rows in whole tiles, so they never touch the
+ * same pixels or damage flags and don't need to take any locks. Errors are
+ * reported here, as MPI is never initialized on this path.
+ * Returns NULL
+ * @arg: Thread state
+ */
+static void *inproc_filter_rows(void *arg)
+{
+    struct inproc_thread *t = arg;
+    pin_thread(t->index);
+    FILE *file = fopen(g_opts.input_path, "rb");
+    if (!file
+        || fseek(file, (long)t->row_start * BITMAP_STRIDE, SEEK_SET)) {
+        errf("could not open `%s': %s", g_opts.input_path, strerror(errno));
+        if (file)
+            fclose(file);
+        t->failed = 1;
+        return NULL;
+    }
+
+    uint8_t *band = try_alloc_buffer((size_t)TILE_SIZE * BITMAP_STRIDE);
+    if (!band) {
+        errf("could not allocate a band of rows");
+        fclose(file);
+        t->failed = 1;
+        return NULL;
+    }
+    for (int y = t->row_start; y < t->row_end; y += TILE_SIZE) {
+        struct tile_header tile = { 0, (uint16_t)y, BITMAP_WIDTH,
+            (uint16_t)min(TILE_SIZE, t->row_end - y), 0 };
+        size_t len = (size_t)tile.h * BITMAP_STRIDE;
+        if (fread(band, 1, len, file) != len) {
+            errf("could not read `%s'", g_opts.input_path);
+            t->failed = 1;
+            break;
+        }
+        apply_point_filters(band, (size_t)tile.h * BITMAP_WIDTH,
+            t->chain->stages, t->chain->len);
+        canvas_draw_tile(t->canvas, &tile, band);
+    }
+
+    free_buffer(band);
+    fclose(file);
+    return NULL;
+}
+
+/* Renders small inputs without MPI: the rows get read, filtered and drawn
+ * by a pool of threads of this very process, instead of by spawned
+ * workers. Only plain runs with point filters qualify.
+ * Returns -1 if workers are needed after all, the exit status otherwise
+ */
+static int run_in_process(void)
+{
+    if (g_opts.spawn || g_opts.num_layers || g_opts.diff_path
+        || g_opts.stats || g_opts.cache_dir || g_opts.keep_alive
+        || g_opts.sequence || g_opts.zoom || g_opts.progressive
+        || g_opts.share || g_opts.headless)
+        return -1;
+
+    /* Several renderers launched together need MPI to split the canvas.
+     * MPI isn't up yet, so go by what launchers leave in the environment,
+     * and stay on the safe side under PMIx if it doesn't tell the size. */
+    const char *job_size = getenv("OMPI_COMM_WORLD_SIZE");
+    if (!job_size)
+        job_size = getenv("PMI_SIZE");
+    if (!job_size)
+        job_size = getenv("SLURM_NTASKS");
+    if (job_size ? atoi(job_size) > 1 : getenv("PMIX_RANK") != NULL)
+        return -1;
+
+    /* Leave reporting bad inputs to the workers. */
+    struct stat st;
+    if (stat(g_opts.input_path, &st) || !st.st_size
+        || st.st_size % BITMAP_STRIDE || st.st_size > INPROC_MAX_BYTES)
+        return -1;
+
+    struct filter_chain chain;
+    if (parse_filters(g_opts.filters, &chain) < 0)
+        return EXIT_FAILURE;
+    if (!is_point_chain(&chain))
+        return -1;
+
+    int num_threads = parse_num_workers(g_opts.num_workers);
+    if (num_threads < 1) {
+        errf("invalid number of workers (%d)", num_threads);
+        return EXIT_FAILURE;
+    }
+
+    g_is_renderer = 1;
+    g_rank = 0;
+    g_num_places = num_threads;
+    init_affinity();
+    for (size_t i = 0; i < chain.len; i++) {
+        struct filter *f = &chain.stages[i];
+        if (f->op != 'u')
+            continue;
+
+        char path[FILENAME_MAX];
+        snprintf(path, sizeof(path), "%.*s", f->path_len, f->path);
+        logf("loading 3D LUT `%s'", path);
+        if (!(f->lut = parse_cube_file(path))) {
+            free_filter_state(&chain);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct canvas canvas;
+    memset(&canvas, 0, sizeof(canvas));
+    canvas.pixels = try_alloc_buffer(CANVAS_BYTES);
+    if (!canvas.pixels) {
+        errf("could not allocate the framebuffer");
+        free_filter_state(&chain);
+        return EXIT_FAILURE;
+    }
+    memset(canvas.pixels, 0, CANVAS_BYTES);
+    renderer_rows(0, 1, &canvas.top, &canvas.bottom);
+    if (open_window(&canvas)) {
+        free_buffer(canvas.pixels);
+        free_filter_state(&chain);
+        return EXIT_FAILURE;
+    }
+
+    /* Hand rows out to threads the way they would be to workers. */
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int num_rows = min((int)(st.st_size / BITMAP_STRIDE), BITMAP_HEIGHT);
+    g_num_slices = num_threads;
+    struct inproc_thread *threads = calloc(num_threads, sizeof(*threads));
+    if (!threads) {
+        errf("could not allocate %d threads", num_threads);
+        num_threads = 0;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        struct inproc_thread *t = &threads[i];
+        t->index = i;
+        t->chain = &chain;
+        t->canvas = &canvas;
+        worker_rows(i, num_rows, &t->row_start, &t->row_end);
+        int err = pthread_create(&t->thread, NULL, inproc_filter_rows, t);
+        if (err) {
+            errf("could not create thread %d: %s", i, strerror(err));
+            num_threads = i;
+            break;
+        }
+    }
+
+    /* Threads report their own errors. */
+    int failed = num_threads < g_num_slices;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        failed |= threads[i].failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(threads);
+    free_filter_state(&chain);
+
+    if (!failed) {
+        canvas_flush(&canvas);
+        logf("filtered %d rows on %d threads in %.1f ms", num_rows,
+            num_threads,
+            (end.tv_sec - start.tv_sec) * 1e3
+                + (end.tv_nsec - start.tv_nsec) / 1e6);
+        wait_for_close(&canvas);
+    }
+    close_window(&canvas);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
+/* Program entry point.
+ * This function returns EXIT_SUCCESS or EXIT_FAILURE if an error occurred
+ * during MPI initialization.
+ * @argc: Number of arguments
+ * @argv: Arguments passed to the program, excluding those of mpicc
+ */
+int main(int argc, char **argv)
+{
+    int num_positional = parse_options(argc, argv);
+    if (num_positional < 0)
+        return EXIT_FAILURE;
+
+    if (num_positional < 2) {
+        printf("usage: " PROGNAME
+               " [OPTIONS] NUM_WORKERS INPUT_FILE [FILTERS]\n\n"
+               "options:\n"
+               "  --layer=MODE:PATH[@OPACITY]  composite an RGB(A) image "
+               "over the input;\n"
+               "                               MODE is over, multiply, "
+               "screen or difference\n"
+               "  --diff=PATH                  compare the input against "
+               "PATH and show the\n"
+               "                               pixels that changed\n"
+               "  --diff-threshold=N           ignore channel differences "
+               "of up to N\n"
+               "  --stats[=PATH]               print statistics of the "
+               "input image, and\n"
+               "                               write them to PATH as JSON\n"
+               "  --cache=DIR                  reuse filtered results stored "
+               "in DIR\n"
+               "  --watch                      keep running and re-render "
+               "the input file\n"
+               "                               whenever it changes\n"
+               "  --control=FIFO               read filter strings to switch "
+               "to, one per\n"
+               "                               line, from FIFO\n"
+               "  --bind=KEY:FILTERS           switch to FILTERS when KEY is "
+               "pressed\n"
+               "  --frames=N                   INPUT_FILE holds N frames, or "
+               "is a pattern\n"
+               "                               such as frame%%04d.rgb of up "
+               "to N files\n"
+               "  --zoom=LEVEL                 show the input zoomed out to "
+               "1/2^LEVEL of its\n"
+               "                               size, and as many more rows "
+               "as fit\n"
+               "  --share                      have the renderer filter some "
+               "rows too,\n"
+               "                               while it's idle\n"
+               "  --headless                   receive pixels without showing "
+               "them\n"
+               "  --threads=N                  filter with N threads in every "
+               "worker, so\n"
+               "                               fewer workers are needed\n"
+               "  --affinity=POLICY            pin threads to CPUs, either "
+               "compact, scatter\n"
+               "                               or a list such as 0,2,4-7\n"
+               "  --layout=LAYOUT              lay rows out for warps as "
+               "rows or as\n"
+               "                               Z-ordered tiles (morton)\n"
+               "  --spawn                      spawn workers even for inputs "
+               "small enough\n"
+               "                               to be filtered by threads\n"
+               "  --browse                     scroll through INPUT_FILE with "
+               "the arrow,\n"
+               "                               Page Up/Down, Home and End "
+               "keys, fetching\n"
+               "                               rows as they come into sight\n"
+               "  --progressive                send a coarse image first, then"
+               " refine it\n"
+               "  --fps=RATE                   play frames back at no more "
+               "than RATE,\n"
+               "                               lowering quality to keep up "
+               "with it\n\n");
+        return EXIT_SUCCESS;
+    }
+
+#ifndef _WIN32
+    int status = run_in_process();
+    if (status >= 0)
+        return status;
+#endif
+
+    /* Worker pool threads leave MPI calls to the main thread. */
+    int thread_level;
+    if (MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_level)
+        != MPI_SUCCESS) {
+        errf("MPI initialization failed");
+        return EXIT_FAILURE;
+    }
+
+    MPI_Check(MPI_Comm_rank(MPI_COMM_WORLD, &g_rank));
+    MPI_Check(MPI_Comm_size(MPI_COMM_WORLD, &g_size));
+    g_num_slices = g_size;
+
+    MPI_Comm parent_comm;
+    MPI_Check(MPI_Comm_get_parent(&parent_comm));
+
+    if (parent_comm == MPI_COMM_NULL) {
+        /* I'm a renderer process. There may be a few, each showing a band
+         * of the canvas. */
         g_is_renderer = 1;
+        g_num_renderers = g_size;
+        if (g_size > CANVAS_TILES_Y
+            || (g_size > 1 && (g_opts.keep_alive || g_opts.share))) {
+            if (g_rank == 0) {
+                errf("up to %d renderers are supported, and only one with "
+                     "--watch, --control, --bind, --browse or --share",
+                    CANVAS_TILES_Y);
+            }
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            MPI_Finalize();
+            return EXIT_FAILURE;
+        }
 
         /* Spawn as many worker processes as needed. */
-        int num_workers = parse_num_workers(argv[1]);
+        int num_workers = parse_num_workers(g_opts.num_workers);
         if (num_workers < 1) {
             errf("invalid number of workers (%d)", num_workers);
             MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
@@ -405,28 +6345,57 @@ int main(int argc, char **argv)
             return EXIT_FAILURE;
         }
 
+        /* Workers get the very same arguments, plus --spawn so that they
+         * don't go in-process themselves. */
         MPI_Comm child_comm;
-        char *children_argv[] = { argv[1], argv[2], NULL, NULL };
-
-        if (argc >= 4) {
-            /* Add filter string. */
-            children_argv[2] = argv[3];
-        }
+        char **children_argv = calloc(argc + 1, sizeof(char *));
+        memcpy(children_argv, argv + 1, (argc - 1) * sizeof(char *));
+        children_argv[argc - 1] = "--spawn";
 
         MPI_Check(
             MPI_Comm_spawn(argv[0], children_argv, num_workers, MPI_INFO_NULL,
                 0, MPI_COMM_WORLD, &child_comm, MPI_ERRCODES_IGNORE));
+        free(children_argv);
+
+#ifndef _WIN32
+        g_num_places = g_size + num_workers * g_opts.num_threads;
+        g_first_place = g_rank;
+        init_affinity();
+        pin_thread(0);
+#endif
 
-        /* Perform rendering. */
+        /* Perform rendering, receiving tiles into a buffer of the pool. */
+        init_msg_pool(&g_msg_pool, 1, TILE_MSG_MAX);
         perform_rendering(&child_comm);
+        destroy_msg_pool(&g_msg_pool);
     } else {
-        /* Obtain filter string from command line arguments. */
-        char *filter = NULL;
-        if (argc > 3)
-            filter = argv[3];
-
-        /* Perform parallel read. */
-        read_data(argv[2], filter);
+        /* Perform parallel read, filtering on a pool of threads if asked
+         * to. */
+#ifndef _WIN32
+        int num_renderers;
+        MPI_Check(MPI_Comm_remote_size(parent_comm, &num_renderers));
+        g_num_places = num_renderers + g_size * g_opts.num_threads;
+        g_first_place = num_renderers + g_rank * g_opts.num_threads;
+        init_affinity();
+        pin_thread(0);
+#endif
+        if (thread_level >= MPI_THREAD_FUNNELED) {
+            g_pool = create_pool(g_opts.num_threads);
+            if (g_pool)
+                logf("filtering on %d threads", g_pool->num_threads);
+        } else if (g_opts.num_threads > 1) {
+            errf("MPI lacks thread support, filtering on a single thread");
+        }
+        init_msg_pool(&g_msg_pool, TILE_POOL_SIZE, TILE_MSG_MAX);
+        tune_block_size();
+        logf("streaming rows in blocks of %d bytes",
+            g_block_bands * TILE_SIZE * BITMAP_STRIDE);
+        read_data(g_opts.input_path, g_opts.filters);
+        destroy_pool(g_pool);
+        logf("message pool: %llu tiles sent, %llu waits for a free buffer, "
+             "%llu buffers allocated",
+            g_msg_pool.num_msgs, g_msg_pool.num_waits, g_num_allocs);
+        destroy_msg_pool(&g_msg_pool);
     }
 
     MPI_Finalize();
@@ -0,0 +1,466 @@
+/*
+ * mpi_x11blit -- Renders raw RGB data supplied by peers in parallel
+ * Copyright (c) 2021 Ángel Pérez <angel@ttm.sh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Tests, run by every process of `mpirun -n 3' as if it were a worker. */
+
+#define main mpi_x11blit_main
+#include "../src/mpi_x11blit.c"
+#undef main
+
+#define expect(cond, f, ...)                                                  \
+    {                                                                         \
+        if (!(cond)) {                                                        \
+            errf("%s:%d: " f, __func__, __LINE__, ##__VA_ARGS__);             \
+            g_num_failures++;                                                 \
+        }                                                                     \
+    }
+
+static int g_num_failures;
+
+/* Fills a buffer with noise, the same on every process.
+ * @buf: Buffer
+ * @len: Length of the buffer
+ * @seed: Seed of the noise
+ */
+static void fill_noise(uint8_t *buf, size_t len, uint32_t seed)
+{
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = (uint8_t)(seed >> 16);
+    }
+}
+
+/* Warps landing on whole pixels copy them, whichever worker owns them. The
+ * shears need more remote tiles per row than the cache holds. */
+static void test_warp_whole_pixels(void)
+{
+    static const int maps[][6] = {
+        { 1, 0, 0, 0, 1, 0 },
+        { 1, 0, 3, 0, 1, -45 },
+        { 1, 0, 3, 2, 1, -50 },
+        { 1, 0, 0, 6, 1, -1200 },
+        { 0, 1, 0, 1, 0, 0 },
+    };
+    int num_rows = 7 * TILE_SIZE + 5, row_start, row_end;
+    size_t len = (size_t)num_rows * BITMAP_STRIDE;
+    uint8_t *image = malloc(len), *buf = malloc(len);
+
+    fill_noise(image, len, 51);
+    worker_rows(g_rank, num_rows, &row_start, &row_end);
+
+    for (size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+        const int *m = maps[i];
+        struct filter f = { .op = 'w', .num_args = 6 };
+        for (int j = 0; j < 6; j++)
+            f.args[j] = m[j];
+
+        /* Twice, as the second pass runs with the state of the first. */
+        for (int pass = 0; pass < 2; pass++) {
+            memcpy(buf, image + (size_t)row_start * BITMAP_STRIDE,
+                (size_t)(row_end - row_start) * BITMAP_STRIDE);
+            warp_strip(buf, row_start, row_end, num_rows, &f);
+
+            int num_wrong = 0;
+            for (int y = row_start; y < row_end; y++) {
+                for (int x = 0; x < BITMAP_WIDTH; x++) {
+                    static const uint8_t black[BITMAP_BPP];
+                    int sx = m[0] * x + m[1] * y + m[2],
+                        sy = m[3] * x + m[4] * y + m[5];
+                    const uint8_t *want = sx >= 0 && sy >= 0
+                            && sx < BITMAP_WIDTH && sy < num_rows
+                        ? image + (size_t)sy * BITMAP_STRIDE + sx * BITMAP_BPP
+                        : black;
+                    num_wrong += memcmp(buf
+                            + (size_t)(y - row_start) * BITMAP_STRIDE
+                            + x * BITMAP_BPP,
+                        want, BITMAP_BPP)
+                        != 0;
+                }
+            }
+            expect(!num_wrong, "map %zu, pass %d: %d pixels wrong", i, pass,
+                num_wrong);
+        }
+        free_warp(f.warp);
+    }
+
+    free(image);
+    free(buf);
+}
+
+/* Applies a filter string made of point filters to a buffer of pixels.
+ * @buf: Pixel data
+ * @num_pixels: Number of pixels in the buffer
+ * @filters: Filter string
+ */
+static void filter_pixels(uint8_t *buf, size_t num_pixels, const char *filters)
+{
+    struct filter_chain chain;
+    expect(!parse_filters(filters, &chain), "`%s' won't parse", filters);
+    apply_point_filters(buf, num_pixels, chain.stages, chain.len);
+}
+
+/* Grayscale, lighten and darken give exactly what the original truncating
+ * filters did, for every colour, with or without SIMD. */
+static void test_legacy_filters(void)
+{
+    static const char ops[] = { 'g', 'l', 'd' };
+    size_t num_pixels = 256 * 256;
+    uint8_t *buf = malloc(num_pixels * BITMAP_BPP);
+
+    for (int i = 0; i < 3; i++) {
+        int num_wrong = 0;
+        for (int b = 0; b < 256; b++) {
+            for (size_t j = 0; j < num_pixels; j++) {
+                buf[j * BITMAP_BPP] = (uint8_t)j;
+                buf[j * BITMAP_BPP + 1] = (uint8_t)(j >> 8);
+                buf[j * BITMAP_BPP + 2] = (uint8_t)b;
+            }
+
+            /* Leave a few pixels over for the scalar kernel. */
+            size_t n = num_pixels - b % 4;
+            char filters[] = { ops[i], 0 };
+            filter_pixels(buf, n, filters);
+
+            for (size_t j = 0; j < n; j++) {
+                uint8_t *p = buf + j * BITMAP_BPP;
+                int in[3] = { (uint8_t)j, (uint8_t)(j >> 8), b };
+                for (int c = 0; c < 3; c++) {
+                    int want = ops[i] == 'g' ? (in[0] + in[1] + in[2]) / 3
+                        : ops[i] == 'l'      ? in[c] + (255 - in[c]) / 4
+                                             : in[c] * 3 / 4;
+                    num_wrong += p[c] != want;
+                }
+            }
+        }
+        expect(!num_wrong, "`%c': %d channels wrong", ops[i], num_wrong);
+    }
+
+    free(buf);
+}
+
+/* A run of colour matrices folds into one that gives the same pixels as
+ * applying them one by one, exactly if every matrix is exact in fixed point
+ * and give or take a level otherwise. Pixels are kept away from the ends of
+ * the range, which stages applied one by one clip to. */
+static void test_matrix_fusion(void)
+{
+    static const struct {
+        const char *filters;
+        int tolerance;
+    } cases[] = {
+        { "ix(2,0,1)i", 0 },
+        { "x(1,1,0)m(0,0,1,0,1,0,0,0,0,1,0,-16)i", 0 },
+        { "S(0.5)S(1.5)", 1 },
+        { "h(30)h(-30)", 1 },
+        { "S(0.8)h(20)", 1 },
+        { "yY", 1 },
+    };
+    size_t num_pixels = 4099, len = num_pixels * BITMAP_BPP;
+    uint8_t *fused = malloc(len), *staged = malloc(len);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        fill_noise(fused, len, 52);
+        for (size_t j = 0; j < len; j++)
+            fused[j] = 64 + fused[j] / 2;
+        memcpy(staged, fused, len);
+
+        filter_pixels(fused, num_pixels, cases[i].filters);
+        for (const char *str = cases[i].filters; *str;) {
+            const char *end = str + 1;
+            if (*end == '(')
+                end = strchr(end, ')') + 1;
+
+            char stage[64];
+            memcpy(stage, str, end - str);
+            stage[end - str] = 0;
+            filter_pixels(staged, num_pixels, stage);
+            str = end;
+        }
+
+        int max_diff = 0;
+        for (size_t j = 0; j < len; j++) {
+            if (abs(fused[j] - staged[j]) > max_diff)
+                max_diff = abs(fused[j] - staged[j]);
+        }
+        expect(max_diff <= cases[i].tolerance, "`%s': off by %d",
+            cases[i].filters, max_diff);
+    }
+
+    free(fused);
+    free(staged);
+}
+
+/* Tetrahedral interpolation gives back the table entries at the lattice
+ * points, and tables with an empty domain are turned down. */
+static void test_lut3d_lattice(void)
+{
+    enum { N = 18, STEP = 255 / (N - 1) };
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_mpi_x11blit.%d.cube", g_rank);
+
+    uint8_t *levels = malloc(N * N * N * 3);
+    fill_noise(levels, N * N * N * 3, 53);
+    FILE *file = fopen(path, "w");
+    fprintf(file, "TITLE \"noise\"\nLUT_3D_SIZE %d\n", N);
+    for (int i = 0; i < N * N * N * 3; i += 3) {
+        fprintf(file, "%.9f %.9f %.9f\n", levels[i] / 255.0,
+            levels[i + 1] / 255.0, levels[i + 2] / 255.0);
+    }
+    fclose(file);
+
+    struct lut3d *lut = parse_cube_file(path);
+    expect(lut, "noise LUT won't load");
+    if (lut) {
+        uint8_t *buf = malloc(N * N * N * BITMAP_BPP);
+        for (int i = 0; i < N * N * N; i++) {
+            buf[i * BITMAP_BPP] = (uint8_t)(i % N * STEP);
+            buf[i * BITMAP_BPP + 1] = (uint8_t)(i / N % N * STEP);
+            buf[i * BITMAP_BPP + 2] = (uint8_t)(i / N / N * STEP);
+        }
+        apply_lut3d(buf, N * N * N, lut);
+
+        int num_wrong = 0;
+        for (int i = 0; i < N * N * N; i++) {
+            for (int c = 0; c < 3; c++)
+                num_wrong += buf[i * BITMAP_BPP + c] != levels[i * 3 + c];
+        }
+        expect(!num_wrong, "%d channels off the lattice entries", num_wrong);
+        free(buf);
+        free(lut->entries);
+        free(lut);
+    }
+
+    file = fopen(path, "w");
+    fprintf(file, "LUT_3D_SIZE 2\nDOMAIN_MIN 0 0.5 0\nDOMAIN_MAX 1 0.5 1\n");
+    for (int i = 0; i < 8; i++)
+        fprintf(file, "%d %d %d\n", i & 1, i >> 1 & 1, i >> 2);
+    fclose(file);
+    lut = parse_cube_file(path);
+    expect(!lut, "LUT with an empty domain loaded");
+
+    remove(path);
+    free(levels);
+}
+
+/* Temporal filters give what their definitions say over a few frames, with
+ * or without SIMD, and whichever parts of a frame they are given at once. */
+static void test_temporal_filters(void)
+{
+    static const char *const cases[] = { "a(3)", "f", "M(2)", "M(0)" };
+    enum { NUM_FRAMES = 5 };
+    size_t len = 4099 * BITMAP_BPP;
+    uint8_t *frames = malloc(NUM_FRAMES * len), *buf = malloc(len);
+    fill_noise(frames, NUM_FRAMES * len, 62);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct filter_chain chain;
+        expect(!parse_filters(cases[i], &chain), "`%s' won't parse",
+            cases[i]);
+        load_filter_state(&chain);
+
+        int num_wrong = 0;
+        for (int k = 0; k < NUM_FRAMES; k++) {
+            /* In two parts, as bands of rows are filtered. */
+            memcpy(buf, frames + k * len, len);
+            prepare_history(&chain.stages[0], len);
+            apply_temporal_range(buf, 0, len / 3, &chain.stages[0]);
+            apply_temporal_range(buf, len / 3, len, &chain.stages[0]);
+            advance_history(&chain.stages[0]);
+
+            for (size_t j = 0; j < len; j++) {
+                int want = 0, first = cases[i][0] == 'a' ? k - 2
+                    : cases[i][2] == '2'                  ? k - 1
+                                                          : 0;
+                first = first < 0 ? 0 : first;
+                if (cases[i][0] == 'a') {
+                    for (int f = first; f <= k; f++)
+                        want += frames[f * len + j];
+                    want = (want + (k - first + 1) / 2) / (k - first + 1);
+                } else if (cases[i][0] == 'f') {
+                    want = k ? abs(frames[k * len + j]
+                                   - frames[(k - 1) * len + j])
+                             : 0;
+                } else {
+                    for (int f = first; f <= k; f++) {
+                        if (frames[f * len + j] > want)
+                            want = frames[f * len + j];
+                    }
+                }
+                num_wrong += buf[j] != want;
+            }
+        }
+        expect(!num_wrong, "`%s': %d bytes wrong", cases[i], num_wrong);
+        free_filter_state(&chain);
+    }
+
+    free(frames);
+    free(buf);
+}
+
+/* Tiles packed at a lower resolution have as many pixels as the renderer
+ * expects, and flat tiles stay flat, odd edges included. */
+static void test_pack_tile_scales(void)
+{
+    static const uint8_t colour[BITMAP_BPP] = { 17, 128, 250 };
+    int w = 27, h = 13;
+    uint8_t *src = malloc((size_t)h * BITMAP_STRIDE);
+    struct tile_header *tile = malloc(sizeof(*tile) + TILE_BYTES);
+    for (int i = 0; i < h * BITMAP_WIDTH; i++)
+        memcpy(src + i * BITMAP_BPP, colour, BITMAP_BPP);
+
+    for (int s = 0; s <= PROGRESSIVE_SCALE; s++) {
+        *tile = (struct tile_header) { 0, 0, (uint16_t)w, (uint16_t)h,
+            (uint16_t)s };
+        size_t num_pixels = (size_t)((w + (1 << s) - 1) >> s)
+            * ((h + (1 << s) - 1) >> s);
+        size_t len = pack_tile(tile, src, BITMAP_STRIDE);
+        expect(len == sizeof(*tile) + num_pixels * BITMAP_BPP,
+            "scale %d: %zu bytes", s, len);
+
+        int num_wrong = 0;
+        const uint8_t *pixels = (const uint8_t *)(tile + 1);
+        for (size_t i = 0; i < num_pixels; i++) {
+            num_wrong
+                += memcmp(pixels + i * BITMAP_BPP, colour, BITMAP_BPP) != 0;
+        }
+        expect(!num_wrong, "scale %d: %d pixels wrong", s, num_wrong);
+    }
+
+    free(tile);
+    free(src);
+}
+
+/* Results come back from the cache as stored, whatever the rows asked
+ * for, and entries for other keys or image sizes miss. */
+static void test_cache_round_trip(void)
+{
+    const uint64_t key = 0x5705705705705705ull;
+    int num_rows = 7 * TILE_SIZE + 3, row_start, row_end;
+    size_t len = (size_t)num_rows * BITMAP_STRIDE;
+    uint8_t *image = malloc(len);
+
+    g_opts.cache_dir = "/tmp";
+    fill_noise(image, len, 57);
+    worker_rows(g_rank, num_rows, &row_start, &row_end);
+    cache_store(key, image + (size_t)row_start * BITMAP_STRIDE, row_start,
+        row_end);
+
+    /* Read back the rows of another worker. */
+    worker_rows(g_size - 1 - g_rank, num_rows, &row_start, &row_end);
+    uint8_t *buf = cache_lookup(key, row_start, row_end, num_rows);
+    expect(buf, "cache entry missing");
+    if (buf) {
+        expect(!memcmp(buf, image + (size_t)row_start * BITMAP_STRIDE,
+                   (size_t)(row_end - row_start) * BITMAP_STRIDE),
+            "cache entry holds other rows");
+        free_buffer(buf);
+    }
+
+    buf = cache_lookup(key + 1, row_start, row_end, num_rows);
+    expect(!buf, "hit for another key");
+    free_buffer(buf);
+    buf = cache_lookup(key, row_start, row_end, num_rows + 1);
+    expect(!buf, "hit for another image size");
+    free_buffer(buf);
+
+    if (!g_rank) {
+        char path[FILENAME_MAX];
+        cache_path(path, key);
+        remove(path);
+    }
+    g_opts.cache_dir = NULL;
+    free(image);
+}
+
+/* Z-order ranks number the tiles of a strip one-to-one, gaps skipped, and
+ * pixels read back through warp_pixel() from a tiled strip are the ones
+ * that were laid out. */
+static void test_morton_layout(void)
+{
+    static const int heights[] = { 1, 3, 7 };
+    for (size_t h = 0; h < sizeof(heights) / sizeof(heights[0]); h++) {
+        int tiles_y = heights[h], num_tiles = MORTON_TILES_X * tiles_y;
+        uint32_t *index = malloc(num_tiles * sizeof(uint32_t));
+        uint8_t *seen = calloc(num_tiles, 1);
+        morton_index(index, tiles_y);
+
+        int num_bad = 0;
+        for (int t = 0; t < num_tiles; t++) {
+            if (index[t] >= (uint32_t)num_tiles || seen[index[t]]++)
+                num_bad++;
+        }
+        expect(!num_bad, "%d of %d tiles misplaced in a strip %d tiles tall",
+            num_bad, num_tiles, tiles_y);
+
+        /* Leave the last tile row partly empty. */
+        int num_rows = tiles_y * MORTON_TILE - MORTON_TILE / 2 + 5;
+        size_t len = (size_t)num_rows * BITMAP_STRIDE;
+        uint8_t *rows = malloc(len);
+        fill_noise(rows, len, 75 + tiles_y);
+
+        struct warp_state state;
+        memset(&state, 0, sizeof(state));
+        state.row_start = 0;
+        state.row_end = state.num_rows = num_rows;
+        state.index = index;
+        state.local = malloc((size_t)num_tiles * MORTON_TILE_BYTES);
+        to_morton(state.local, rows, num_rows, index);
+
+        int last = -1, num_wrong = 0;
+        for (int y = 0; y < num_rows; y++) {
+            for (int x = 0; x < BITMAP_WIDTH; x++) {
+                num_wrong += memcmp(warp_pixel(&state, x, y, &last),
+                                 rows + (size_t)y * BITMAP_STRIDE
+                                     + (size_t)x * BITMAP_BPP,
+                                 BITMAP_BPP)
+                    != 0;
+            }
+        }
+        expect(!num_wrong, "%d pixels differ after a Z-order round trip",
+            num_wrong);
+
+        free(state.local);
+        free(rows);
+        free(seen);
+        free(index);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    MPI_Check(MPI_Init(&argc, &argv));
+    MPI_Check(MPI_Comm_rank(MPI_COMM_WORLD, &g_rank));
+    MPI_Check(MPI_Comm_size(MPI_COMM_WORLD, &g_size));
+
+    test_warp_whole_pixels();
+    test_legacy_filters();
+    test_matrix_fusion();
+    test_lut3d_lattice();
+    test_temporal_filters();
+    test_pack_tile_scales();
+    test_cache_round_trip();
+    test_morton_layout();
+
+    int num_failures;
+    MPI_Check(MPI_Allreduce(&g_num_failures, &num_failures, 1, MPI_INT,
+        MPI_SUM, MPI_COMM_WORLD));
+    if (!g_rank)
+        logf("%d failures", num_failures);
+
+    MPI_Finalize();
+    return num_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}